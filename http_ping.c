@@ -25,14 +25,23 @@
 ** SUCH DAMAGE.
 */
 
+#if defined(linux) && ! defined(_GNU_SOURCE)
+#define _GNU_SOURCE	/* for sched_setaffinity() */
+#endif
+
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h>
+#include <math.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/time.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <netdb.h>
@@ -40,6 +49,9 @@
 #include <signal.h>
 #include <setjmp.h>
 #include <time.h>
+#include <sched.h>
+#include <sys/wait.h>
+#include <poll.h>
 
 #ifdef USE_SSL
 #include <openssl/ssl.h>
@@ -47,18 +59,42 @@
 #include <openssl/err.h>
 #endif
 
+#ifdef USE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef USE_BROTLI
+#include <brotli/decode.h>
+#endif
+
 #include "port.h"
 
+#ifdef HAVE_SO_TIMESTAMPING
+#include <linux/net_tstamp.h>
+#endif
+
+#if defined(OS_Linux) && ! defined(TCP_FASTOPEN_CONNECT)
+#define TCP_FASTOPEN_CONNECT 30	/* not in older libc headers */
+#endif
+
 #define INTERVAL 5
 #define TIMEOUT 15
 
 #define max(a,b) ((a)>=(b)?(a):(b))
 #define min(a,b) ((a)<=(b)?(a):(b))
 
+#ifdef __GNUC__
+#define mem_barrier() __sync_synchronize()
+#else
+#define mem_barrier()
+#endif
+
 static char* url;
 static int url_protocol;
 static char url_host[5000];
 static unsigned short url_port;
+static int url_unix;
+static char url_unix_path[sizeof(((struct sockaddr_un*) 0)->sun_path)];
 static char* url_filename;
 static char* request_data_file;
 /* static char* request_data; */
@@ -72,16 +108,39 @@ static char* vhost;
 #endif
 
 static unsigned short port;
-static int conn_fd;
+static int conn_fd = -1;
 #ifdef USE_SSL
 static SSL* ssl;
 #endif
 static int conn_state, conn_state;
 static int got_response;
 static struct timeval started_at, connect_at, response_at, finished_at;
+static struct timeval tcp_at;
+
+/* https through a -proxy goes over a CONNECT tunnel; tunnel_at is when
+** the proxy said the tunnel was up.
+*/
+static int tunnelled;
+static struct timeval tunnel_at;
+
+/* -proxy-keepalive: the proxy connection, and for https the tunnel and
+** TLS session on it, is kept from one probe to the next.  keep_origin is
+** the origin it was opened for, and conn_reused says whether this probe
+** went out on it.
+*/
+static int proxy_keep;
+static char keep_origin[600];
+static int conn_reused;
 static long content_length;
 static long bytes;
 
+/* Response headers are also collected a line at a time, for the ones
+** the state machine below doesn't pick out itself.
+*/
+static char hdr_line[2000];
+static int hdr_len, hdr_lines;
+static int resp_status;
+
 #define ST_BOL 0
 #define ST_TEXT 1
 #define ST_LF 2
@@ -109,23 +168,503 @@ static long bytes;
 
 static char* argv0;
 static int count;
-static int interval;
-static int timeout;
+static double interval;
+static double timeout;
 static int nagle;
 static int quiet;
 static int do_keepalive;
 static int do_proxy;
 static char* proxy_host;
 static unsigned short proxy_port;
+static int do_tcpinfo;
+static int do_timestamps;
+static int do_lowjitter;
+static int lowjitter_cpu;
+static int lowjitter_rtprio;
+static double wakeup_blocking, wakeup_spinning;
+static char* bind_list;
+static int do_linger0;
+static int do_tfo;
+static int probe_mode;
+static int tp_period;
+static long slow_rate;
+static int slow_conns;
+static int rcvbuf;
+static double cap_start, cap_step, cap_max;
+static int cap_binary;
+static double window_secs;
+static double slo_pct, slo_ms, slo_errors;
+static char* profile_file;
+static char* replay_file;
+static double replay_speed;
+
+/* URL and header templates, compiled once into literal text and
+** placeholders so expanding one is just copying and a few random()s.
+*/
+#define TM_TEXT 0
+#define TM_SEQ 1
+#define TM_RAND 2
+#define TM_STR 3
+#define TM_PICK 4
+#define MAX_TM_PARTS 64
+typedef struct {
+    int type;
+    char* text;		/* TM_TEXT: the text; TM_PICK: choices, NUL-separated */
+    int len;		/* TM_TEXT: its length; TM_PICK: how many choices */
+    long n;		/* TM_RAND: the range; TM_STR: the length */
+    } tm_part;
+typedef struct {
+    tm_part parts[MAX_TM_PARTS];
+    int nparts;
+    } template;
+
+#define MAX_HEADERS 32
+static template url_tm;
+static int url_templated;
+static template headers[MAX_HEADERS];
+static int num_headers;
+static long probe_seq;
+
+/* -cache: how the probe was served, from Cache-Status, X-Cache or Age,
+** or a 304 to a -conditional request; and the statistics split on that.
+*/
+#define CC_UNKNOWN 0
+#define CC_HIT 1
+#define CC_MISS 2
+#define CC_REVALIDATED 3
+#define NUM_CC 4
+static char* cc_names[NUM_CC] = { "unknown", "hit", "miss", "revalidated" };
+static int do_cache, do_conditional;
+static int cache_class, cache_status_class, x_cache_class;
+static long resp_age;
+static char resp_etag[200], resp_last_modified[100];
+static char cond_etag[200], cond_last_modified[100];
+
+/* -follow: redirects are followed for up to follow_max hops, each hop
+** timed from its start to the start of the next.  While a chain is under
+** way the probe's own target is kept in home.
+*/
+#define MAX_HOPS 20
+static int follow_max;
+static char resp_location[2000];
+static int num_hops, hop_overflow, hop_moved;
+static int hop_status[MAX_HOPS];
+static long long hop_usecs[MAX_HOPS];
+static long long redirect_usecs;
+static char hop_url[2000];
+
+/* With -follow, requests ask for keep-alive so a hop that stays on the
+** same origin can go out on the connection it came in on.  The reader
+** then stops at the end of the body instead of waiting for EOF.
+*/
+static int conn_keep, resp_close, num_reused;
+
+/* -compress: the Accept-Encoding to send, and how this probe's body is
+** being decoded.  Chunked framing is stripped first, then a compressed
+** body is inflated a piece at a time through dec_buf as it arrives, so
+** memory use doesn't grow with the body.  dec_usecs is the time spent
+** in the decoder.
+*/
+#define ENC_IDENTITY 0
+#define ENC_GZIP 1
+#define ENC_DEFLATE 2
+#define ENC_BR 3
+#define NUM_ENC 4
+static char* enc_names[NUM_ENC] = { "identity", "gzip", "deflate", "br" };
+static char* accept_encoding;
+static int resp_encoding, resp_chunked;
+#define CK_SIZE 0
+#define CK_EXT 1
+#define CK_DATA 2
+#define CK_END 3
+#define CK_TRAILER 4
+#define CK_TRAILER_TEXT 5
+#define CK_DONE 6
+static int chunk_state;
+static long chunk_left;
+#if defined(USE_ZLIB) || defined(USE_BROTLI)
+static char dec_buf[16384];
+#endif
+static int dec_started, dec_done, dec_failed;
+static long long dec_bytes, dec_usecs;
+#ifdef USE_ZLIB
+static z_stream dec_z;
+static int dec_z_ready;
+#endif
+#ifdef USE_BROTLI
+static BrotliDecoderState* dec_br;
+#endif
+
+/* Probe modes. */
+#define MODE_HTTP 0
+#define MODE_TCP 1
+#define MODE_TLS 2
 
 static int terminate;
-static int count_started, count_completed, count_failures, count_timeouts;
-static long total_bytes;
-static jmp_buf jb;
+static sigjmp_buf jb;
+
+/* Timeout phases.  Each may have its own limit in msecs, and -timeout
+** covers the whole probe.  The pending alarm is always for whichever of
+** the current phase's limit and the rest of the total comes first, and
+** to_phase says which one that is.
+*/
+#define TO_DNS 0
+#define TO_CONNECT 1
+#define TO_TLS 2
+#define TO_TTFB 3
+#define TO_IDLE 4
+#define TO_TOTAL 5
+#define NUM_TO 6
+
+static char* to_names[NUM_TO] = {
+    "dns", "connect", "tls", "ttfb", "idle", "total" };
+static int to_limit[NUM_TO];
+static int to_phase;
+static int to_startup;
+static struct timeval to_deadline;
+
+/* Phases. */
+#define PH_TOTAL 0
+#define PH_CONNECT 1
+#define PH_RESPONSE 2
+#define PH_DATA 3
+#define NUM_PHASES 4
+
+/* Histograms are log-linear in microseconds.  Values below HIST_SUB get
+** a bucket each; above that every power of two is split into HIST_SUB
+** buckets, which gives about 3% resolution up to 2^HIST_MAX_BITS usecs.
+*/
+#define HIST_SUB_BITS 5
+#define HIST_SUB ( 1 << HIST_SUB_BITS )
+#define HIST_MAX_BITS 36
+#define HIST_BUCKETS ( ( HIST_MAX_BITS - HIST_SUB_BITS + 1 ) * HIST_SUB )
+
+typedef struct {
+    unsigned int counts[HIST_BUCKETS];
+    } histogram;
+
+/* TCP_INFO metrics. */
+#define TI_RTT 0
+#define TI_MIN_RTT 1
+#define TI_RETRANS 2
+#define TI_LOST 3
+#define TI_CWND 4
+#define TI_RATE 5
+#define NUM_TI 6
+
+/* A min/avg/max accumulator for the secondary metrics. */
+typedef struct {
+    int n;
+    double min, max, sum;
+    } accum;
+
+typedef struct {
+    int started, completed, failures, timeouts, invalid;
+    int phase_timeouts[NUM_TO];
+    int port_failures;
+    long long bytes;
+    double min[NUM_PHASES], max[NUM_PHASES], sum[NUM_PHASES];
+    histogram hist[NUM_PHASES];
+    accum ti[NUM_TI];
+    accum wire, app_noise;
+    histogram tp_hist;
+    accum tp_mean, tp_first_mb;
+    int tp_stalls;
+    double tp_stall_ms;
+    int enc_count[NUM_ENC];
+    long long dec_wire, dec_bytes;
+    accum dec_ratio, dec_ms;
+    accum hops, redirect_ms;
+    accum proxy_ms, tunnel_ms, tls_ms;
+    } probe_stats;
+
+/* The live statistics.  With -stats-file they are mmap'd from that file
+** so other processes can read them.  Updates are bracketed by a seqlock;
+** readers retry until they see the same even sequence number on both
+** sides of their copy.  Bump STATS_VERSION whenever the layout changes.
+*/
+#define STATS_MAGIC "HPSTATS"
+#define STATS_VERSION 11
+
+typedef struct {
+    char magic[8];
+    int version;
+    volatile unsigned int seq;
+    long pid;
+    long long created;
+    int mode;
+    char url[1000];
+    probe_stats s;
+    } stats_shm;
+
+static char* stats_file;
+static stats_shm local_shm;
+
+/* -hist-file: the run's counters and histograms, written at exit in a
+** compact form that -merge adds up.  After the magic and version byte
+** everything is a LEB128 varint, except the doubles, which are their
+** IEEE bits in eight little-endian bytes.  Histograms are sparse, as
+** (gap since the last nonzero bucket, count) pairs.  Bump
+** HIST_FILE_VERSION whenever the layout changes.
+*/
+#define HIST_FILE_MAGIC "HPHIST"
+#define HIST_FILE_VERSION 3
+#define HIST_FILE_COUNTS ( 7 + NUM_TO + NUM_ENC )
+#define HIST_FILE_ACCUMS ( 11 + NUM_TI )
+#define HIST_FILE_MAX \
+    ( 1024 + HIST_FILE_ACCUMS * 40 + ( NUM_PHASES + 1 ) * HIST_BUCKETS * 16 )
+static char* hist_file;
+static stats_shm* shm = &local_shm;
+static probe_stats* st = &local_shm.s;
+static sigset_t stats_mask;
+static int stats_depth;
+
+/* The -mode of the probes being reported on, which for -stats-read and
+** -merge is the one recorded by the run that took them.
+*/
+static int report_mode;
+
+static char* phase_names[NUM_PHASES] = {
+    "total   ", "connect ", "response", "data    " };
+static char* ti_names[NUM_TI] = {
+    "tcp rtt ", "tcp min_rtt", "tcp retrans", "tcp lost",
+    "tcp cwnd", "tcp rate" };
+static char* ti_units[NUM_TI] = {
+    " ms", " ms", "", "", " segs", " Mbit/s" };
+
+#ifdef HAVE_TCP_INFO
+/* The libc struct tcp_info stops short of the fields we want, so append
+** the rest of the kernel's layout.  Older kernels just fill in less.
+*/
+typedef struct {
+    struct tcp_info base;
+    unsigned long long pacing_rate, max_pacing_rate;
+    unsigned long long bytes_acked, bytes_received;
+    unsigned int segs_out, segs_in;
+    unsigned int notsent_bytes, min_rtt;
+    unsigned int data_segs_in, data_segs_out;
+    unsigned long long delivery_rate;
+    } tcp_info_ext;
+#endif /* HAVE_TCP_INFO */
+
+/* Per-probe TCP_INFO readings: ti_connect is taken once the connection
+** is up, ti_values just before it is closed.
+*/
+static int got_tcp_info;
+static double ti_values[NUM_TI];
+static unsigned int ti_connect_retrans;
+
+/* With -tfo, whether the server acked the request data in our SYN, and
+** the statistics split on that.
+*/
+static int tfo_accepted;
+static probe_stats tfo_stats[2];
+
+/* With -proxy-keepalive, the statistics for probes on a new proxy
+** connection and on a reused one.
+*/
+static probe_stats proxy_stats[2];
+
+/* With -cache, the statistics for each way a probe was served. */
+static probe_stats cache_stats[NUM_CC];
+
+/* Per-probe -throughput state.  Data is counted into slots of tp_period
+** msecs; a slot with no data at all is a stall.  Rates are kept in the
+** histograms as KB/s.
+*/
+#define TP_BIG_READ 262144
+#define TP_FIRST_MB 1000000
+static int tp_started;
+static struct timeval tp_slot_start, tp_first_mb_at;
+static long tp_slot_bytes;
+static int tp_slots, tp_stalls;
+static double tp_min_rate;
+static histogram tp_probe_hist;
 
-static float min_total, min_connect, min_response, min_data;
-static float max_total, max_connect, max_response, max_data;
-static float sum_total, sum_connect, sum_response, sum_data;
+/* -slowread pacing: response bytes read so far on this probe. */
+static long slow_total;
+
+/* What a child probe sends back to the parent. */
+#define MAX_CHILDREN 256
+typedef struct {
+    int ok;
+    int timed_out;
+    long bytes;
+    int port_failures;
+    struct timeval started_at, connect_at, response_at, finished_at;
+    struct timeval tcp_at, tunnel_at;
+    int tunnelled;
+    int status, cache_class;
+    long age;
+    char etag[200], last_modified[100];
+    char backend[200];
+    int backend_other;
+    int body_found;
+    unsigned long long body_hash;
+    int encoding, dec_started, dec_done, dec_failed;
+    long long dec_bytes, dec_usecs;
+    int hops, hop_overflow, reused;
+    int hop_status[MAX_HOPS];
+    long long hop_usecs[MAX_HOPS];
+    long long redirect_usecs;
+    } child_result;
+
+/* Child probes in flight in the open-loop modes, and how many sends were
+** skipped because MAX_CHILDREN were already running.
+*/
+static int num_kids;
+static pid_t kid_pids[MAX_CHILDREN];
+static int kid_fds[MAX_CHILDREN];
+static probe_stats* kid_groups[MAX_CHILDREN];
+static int kid_overflows;
+
+/* Probes are also counted in here when it is set, e.g. for the current
+** -capacity step.
+*/
+static probe_stats* group_stats;
+
+/* -gate thresholds, checked over the whole run and, with -gate-window,
+** over each window of that many seconds.  A window's numbers are the
+** difference between snapshots of the statistics at its two ends.
+*/
+#define GK_PCT 0
+#define GK_ERRORS 1
+#define GK_THROUGHPUT 2
+#define GK_RPS 3
+#define MAX_GATES 20
+typedef struct {
+    char* spec;
+    int kind, phase;
+    double pct, limit;
+    int failed;
+    double value;
+    int windows_failed;
+    double worst, worst_at;
+    } gate;
+static gate gates[MAX_GATES];
+static int num_gates;
+static double gate_window;
+static int gate_started, gate_windows;
+static struct timeval run_start, gate_win_start;
+static probe_stats gate_snap, gate_win;
+
+/* -rolling: a ring of one-second slots, each holding the counts and
+** histograms for what finished in that second.  A window's summary is
+** the sum of its last slots, so memory stays the same however long the
+** run goes on.
+*/
+#define ROLL_SLOTS 60
+#define MAX_ROLL_WINDOWS 8
+typedef struct {
+    int started, completed, errors;
+    long long bytes;
+    histogram hist[NUM_PHASES];
+    } roll_slot;
+static roll_slot roll_ring[ROLL_SLOTS];
+static roll_slot roll_sum;
+static int roll_windows[MAX_ROLL_WINDOWS];
+static int num_roll_windows;
+static int roll_started;
+static long roll_slots_done;
+static struct timeval roll_slot_start;
+static probe_stats roll_snap, roll_delta;
+
+/* -ab: probes alternate, in random order within each round, between the
+** URL (A) and a second URL or vhost (B), so both see the same network.
+** Each side has its statistics and its total times for the comparison.
+*/
+#define AB_RESAMPLES 1000
+static char* ab_arg;
+static int ab_side;
+static probe_stats ab_stats[2];
+static double* ab_samples[2];
+static int ab_nsamples[2], ab_maxsamples[2];
+
+/* A stretch of open-loop load with the rate following a shape:
+**   const  a rps
+**   ramp   a to b rps
+**   sine   a rps mean, b rps amplitude, c secs period
+**   burst  a rps, but b rps for the first c secs of every d secs
+*/
+#define SH_CONST 0
+#define SH_RAMP 1
+#define SH_SINE 2
+#define SH_BURST 3
+typedef struct {
+    int shape;
+    double secs;
+    double a, b, c, d;
+    } segment;
+
+/* The -profile segments, each with its own statistics. */
+#define MAX_SEGMENTS 64
+static segment segments[MAX_SEGMENTS];
+static probe_stats seg_stats[MAX_SEGMENTS];
+static int num_segments;
+
+/* Statistics by a string key, such as the -replay path.  The table is
+** open addressing with a fixed size, so memory stays bounded however
+** many distinct keys turn up; once it is full, new keys share "other".
+*/
+#define MAX_KEYS 256
+typedef struct {
+    char* key;
+    probe_stats* s;
+    } key_entry;
+typedef struct {
+    key_entry e[MAX_KEYS * 2];
+    int n;
+    probe_stats other;
+    } key_table;
+
+/* -replay: per-path statistics, the current line's request, and lines
+** that couldn't be parsed.
+*/
+static key_table replay_paths;
+static char replay_method[32], replay_path[2000], replay_vhost[500];
+static long req_body_len;
+static int replay_bad_lines;
+
+/* Response validation.  expect_ok has a flag for each status code that
+** counts as success.  -body-contains is matched as the body streams in
+** with KMP, so it can span reads and nothing is buffered; -body-hash is
+** a 64-bit FNV-1a over the body, also done as it arrives.
+*/
+#define MAX_STATUS 600
+static char expect_ok[MAX_STATUS];
+static char* body_needle;
+static int body_needle_len;
+static int* body_fail;
+static int body_match, body_found;
+static int do_body_hash;
+static unsigned long long body_hash_want, body_hash;
+
+/* -backend: the response header that says which backend served a probe,
+** the statistics for each value of it, and this probe's entry.
+*/
+static char* backend_header;
+static key_table backends;
+static probe_stats* resp_backend;
+static char* resp_backend_name;
+
+/* The -capacity steps so far, for the latency curve at the end. */
+#define MAX_CAP_STEPS 100
+typedef struct {
+    double rate, achieved, errors;
+    double p50, p90, p99, pslo;
+    int ok;
+    } cap_result;
+static cap_result cap_steps[MAX_CAP_STEPS];
+static int num_cap_steps, cap_dropped;
+static double cap_good;
+
+/* Per-probe kernel timestamps for -timestamps.  tx_ts is when the
+** request went out, rx_ts when the first response segment came in.
+** The hardware stamps are only comparable with each other.
+*/
+static struct timeval sent_at;
+static int got_tx_ts, got_rx_ts, got_tx_hw, got_rx_hw;
+static struct timespec tx_ts, rx_ts, tx_hw, rx_hw;
 
 #ifdef USE_SSL
 static SSL_CTX* ssl_ctx = (SSL_CTX*) 0;
@@ -134,16 +673,137 @@ static SSL_CTX* ssl_ctx = (SSL_CTX*) 0;
 
 /* Forwards. */
 static void usage( void );
+static void init_stats( void );
+static void stats_begin( void );
+static void stats_end( void );
+static void clear_stats( probe_stats* s );
+static void record_probe( probe_stats* s, long long* elapsed, long b );
+static void accum_add( accum* a, double v );
+static void report_accum( accum* a, char* name, char* unit );
+static void report_stats( probe_stats* s, int percentiles );
+static int phase_measured( int ph );
+static void report_phases( probe_stats* s, int percentiles );
+static void report_group( probe_stats* s, char* label );
+static void read_stats( char* filename );
+static void write_hist_file( char* filename, probe_stats* s );
+static void merge_hist_files( int nfiles, char** filenames );
+static int hist_index( long long usecs );
+static long long hist_value( int i );
+static void hist_record( histogram* h, long long usecs );
+static long long hist_percentile( histogram* h, double pct );
 static void parse_url( void );
 static void parse_request_file( void );
 static void init_net( void );
+static int fetch_probe( void );
+static int is_redirect( int status );
+static int follow_location( void );
+#ifdef USE_SSL
+static int open_tunnel( void );
+#endif
+static void follow_restore( void );
+static void ab_init( void );
+static void ab_use( int side );
+static void parse_gate( char* spec );
+static void gate_tick( void );
+static void gate_close_window( double secs );
+static void parse_rolling( char* spec );
+static void roll_tick( void );
+static long long roll_next_usecs( void );
+static void roll_close_slot( void );
+static void roll_finish( void );
+static void roll_report( int secs, double last );
+static void idle_secs( double secs );
+static int gate_check( gate* g, probe_stats* s, double secs, double* valueP );
+static int gate_report( void );
+static void stats_delta( probe_stats* d, probe_stats* now, probe_stats* then );
+static void ab_round( void );
+static void ab_sample( double ms );
+static void ab_report( void );
+static double ab_quantile( double* v, int n, double pct );
 static int start_connection( void );
+static void reset_response( void );
+static int send_request( void );
+static int reuse_connection( void );
+static void keep_origin_name( char* buf, int size );
+static int keep_matches( void );
+static int conn_alive( void );
+static int resp_complete( void );
 static void lookup_address( char* hostname, unsigned short port );
+static int resolve_address( char* hostname, unsigned short port );
+static void lookup_unix_path( void );
+static void url_decode( char* to, int tosize, char* from, int fromlen );
+static void lookup_bind_addresses( void );
+static int bind_client_socket( int sockfd );
+static void count_port_failure( void );
 static int open_client_socket( void );
 static int handle_read( void );
 static void handle_term( int sig );
 static void handle_alarm( int sig );
+static int timeout_option( char* opt );
+static void timeout_start( void );
+static void timeout_phase( int phase );
+static void timeout_cancel( void );
+static void sleep_secs( double secs );
+static void tp_reset( void );
+static void tp_account( int n );
+static void slow_pace( int n );
+static void slow_round( void );
+static void probe_started( void );
+static void probe_succeeded( void );
+static void probe_failed( void );
+static void probe_timed_out( int phase );
+static void probe_invalid( char* why );
+static char* validate_probe( void );
+static void parse_expect( char* codes );
+static void body_init( void );
+static void body_feed( char* p, int n );
+static void parse_compress( char* list );
+static void body_data( char* p, int n );
+static void body_decode( char* p, int n );
+static void dec_record( probe_stats* s );
+static probe_stats* probe_backend( void );
+static int spawn_probe( pid_t* pidP );
+static void reap_probe( int fd, pid_t pid );
+static void open_loop( segment* sg, struct timeval* start );
+static void wait_kids( long long usecs );
+static void drain_kids( void );
+static double seg_sends( segment* sg, double t );
+static double seg_time( segment* sg, double n, double from );
+static void seg_describe( segment* sg, char* buf, int size );
+static void read_profile( void );
+static void run_profile( void );
+static void profile_report( void );
+static void send_probe( void );
+static probe_stats* key_lookup( key_table* t, char* key, int len, char** keyP );
+static void report_keys( key_table* t, char* title );
+static int key_cmp( const void* a, const void* b );
+static void run_replay( void );
+static int conn_write( char* buf, int len );
+static int tm_compile( template* t, char* s );
+static int tm_placeholder( tm_part* p, char* spec, int len );
+static int tm_expand( template* t, char* buf, int size );
+static void header_byte( char c );
+static void handle_header( char* line, int len );
+static int header_is( char* line, int len, char* name, char** valueP );
+static int has_word( char* s, char* word );
+static int cache_token( char* value );
+static void capacity_search( void );
+static int capacity_step( double rate );
+static void capacity_report( void );
+static void tp_record( probe_stats* s, long long data_usecs );
 static void close_connection( void );
+static void capture_tcp_info( int at_connect );
+static void finish_probe( void );
+static int conn_read( char* buf, int len );
+static int conn_read_once( char* buf, int len );
+static void init_lowjitter( void );
+static void tune_socket( int fd );
+static void measure_wakeup( void );
+static double wakeup_median( int sv, int spin );
+static void enable_timestamps( int fd );
+static void read_rx_timestamp( struct msghdr* msg );
+static void read_tx_timestamps( void );
+static double wire_latency( void );
 static long long delta_timeval( struct timeval* start, struct timeval* finish );
 
 
@@ -151,20 +811,48 @@ int
 main( int argc, char** argv )
     {
     int argn;
-    float elapsed_total, elapsed_connect, elapsed_response, elapsed_data;
+    int ok, ph, status;
 
     /* Parse args. */
     argv0 = argv[0];
     argn = 1;
     count = -1;
     interval = INTERVAL;
+    timeout = TIMEOUT;
+    parse_expect( "200-399" );
+    (void) memset( (void*) to_limit, 0, sizeof(to_limit) );
     quiet = 0;
     nagle=0;
     do_proxy = 0;
+    proxy_keep = 0;
     do_keepalive = 0;
     method = 0;
     vhost = 0;
     request_data_file = 0;
+    stats_file = 0;
+    hist_file = (char*) 0;
+    do_tcpinfo = 0;
+    do_timestamps = 0;
+    do_lowjitter = 0;
+    lowjitter_cpu = -1;
+    lowjitter_rtprio = 0;
+    bind_list = 0;
+    do_linger0 = 0;
+    do_tfo = 0;
+    probe_mode = MODE_HTTP;
+    tp_period = 0;
+    slow_rate = 0;
+    slow_conns = 1;
+    rcvbuf = 0;
+    cap_max = 0.0;
+    cap_binary = 0;
+    window_secs = 10.0;
+    slo_pct = 99.0;
+    slo_ms = 1000.0;
+    slo_errors = 1.0;
+    profile_file = (char*) 0;
+    replay_file = (char*) 0;
+    replay_speed = 1.0;
     while ( argn < argc && argv[argn][0] == '-' && argv[argn][1] != '\0' )
 	{
 	if ( strncmp( argv[argn], "-count", strlen( argv[argn] ) ) == 0 && argn + 1 < argc )
@@ -178,20 +866,20 @@ main( int argc, char** argv )
 	    }
 	else if ( strncmp( argv[argn], "-interval", strlen( argv[argn] ) ) == 0 && argn + 1 < argc )
 	    {
-	    interval = atoi( argv[++argn] );
-	    if ( interval < 1 && interval )
+	    interval = atof( argv[++argn] );
+	    if ( interval < 0.0 )
 			{
-			(void) fprintf( stderr, "%s: interval will be zero when set to less than one\n", argv0 );
-			interval = 0;
+			(void) fprintf( stderr, "%s: interval must not be negative\n", argv0 );
+			exit( 1 );
 			}
 	    }
 	else if ( strncmp( argv[argn], "-timeout", strlen( argv[argn] ) ) == 0 && argn + 1 < argc )
 	    {
-	    timeout = atoi( argv[++argn] );
-	    if ( timeout < 1 )
+	    timeout = atof( argv[++argn] );
+	    if ( timeout <= 0.0 )
 			{
-			(void) fprintf( stderr, "%s: timeout will be one second when set to less than one\n", argv0 );
-			timeout = 1;
+			(void) fprintf( stderr, "%s: timeout must be positive\n", argv0 );
+			exit( 1 );
 			}
 	    }
 	else if ( strncmp( argv[argn], "-quiet", strlen( argv[argn] ) ) == 0 )
@@ -216,6 +904,10 @@ main( int argc, char** argv )
 			*colon = '\0';
 			}
 	    }
+	else if ( strncmp( argv[argn], "-proxy-keepalive", strlen( argv[argn] ) ) == 0 )
+	    {
+	    proxy_keep = 1;
+	    }
 	else if ( strncmp( argv[argn], "-method", strlen( argv[argn] ) ) == 0 && argn + 1 < argc )
     	{
 		method = argv[++argn];
@@ -228,6 +920,264 @@ main( int argc, char** argv )
     	{
 		request_data_file = argv[++argn];
 		}
+	else if ( strncmp( argv[argn], "-tcpinfo", strlen( argv[argn] ) ) == 0 )
+		{
+#ifdef HAVE_TCP_INFO
+		do_tcpinfo = 1;
+#else
+		(void) fprintf( stderr, "%s: -tcpinfo is not supported on %s\n", argv0, ARCH );
+		exit( 1 );
+#endif
+		}
+	else if ( strncmp( argv[argn], "-timestamps", strlen( argv[argn] ) ) == 0 )
+		{
+#ifdef HAVE_SO_TIMESTAMPING
+		do_timestamps = 1;
+#else
+		(void) fprintf( stderr, "%s: -timestamps is not supported on %s\n", argv0, ARCH );
+		exit( 1 );
+#endif
+		}
+	else if ( strncmp( argv[argn], "-lowjitter", strlen( argv[argn] ) ) == 0 )
+		{
+		do_lowjitter = 1;
+		}
+	else if ( strncmp( argv[argn], "-cpu", strlen( argv[argn] ) ) == 0 && argn + 1 < argc )
+		{
+		do_lowjitter = 1;
+		lowjitter_cpu = atoi( argv[++argn] );
+#ifdef HAVE_SCHED_SETAFFINITY
+		if ( lowjitter_cpu < 0 || lowjitter_cpu >= CPU_SETSIZE )
+		    {
+		    (void) fprintf( stderr, "%s: cpu must be between 0 and %d\n", argv0, CPU_SETSIZE - 1 );
+		    exit( 1 );
+		    }
+#else /* HAVE_SCHED_SETAFFINITY */
+		if ( lowjitter_cpu < 0 )
+		    {
+		    (void) fprintf( stderr, "%s: cpu can't be negative\n", argv0 );
+		    exit( 1 );
+		    }
+#endif /* HAVE_SCHED_SETAFFINITY */
+		}
+	else if ( strncmp( argv[argn], "-rtprio", strlen( argv[argn] ) ) == 0 && argn + 1 < argc )
+		{
+		do_lowjitter = 1;
+		lowjitter_rtprio = atoi( argv[++argn] );
+		}
+	else if ( strncmp( argv[argn], "-bind", strlen( argv[argn] ) ) == 0 && argn + 1 < argc )
+		{
+		bind_list = argv[++argn];
+		}
+	else if ( strncmp( argv[argn], "-linger0", strlen( argv[argn] ) ) == 0 )
+		{
+		do_linger0 = 1;
+		}
+	else if ( strncmp( argv[argn], "-tfo", strlen( argv[argn] ) ) == 0 )
+		{
+#ifdef HAVE_TCP_INFO
+		do_tfo = 1;
+#else
+		(void) fprintf( stderr, "%s: -tfo is not supported on %s\n", argv0, ARCH );
+		exit( 1 );
+#endif
+		}
+	else if ( strncmp( argv[argn], "-mode", strlen( argv[argn] ) ) == 0 && argn + 1 < argc )
+		{
+		++argn;
+		if ( strcmp( argv[argn], "http" ) == 0 )
+		    probe_mode = MODE_HTTP;
+		else if ( strcmp( argv[argn], "tcp" ) == 0 )
+		    probe_mode = MODE_TCP;
+		else if ( strcmp( argv[argn], "tls" ) == 0 )
+		    probe_mode = MODE_TLS;
+		else
+		    usage();
+		}
+	else if ( strncmp( argv[argn], "-throughput", strlen( argv[argn] ) ) == 0 && argn + 1 < argc )
+		{
+		tp_period = atoi( argv[++argn] );
+		if ( tp_period < 1 )
+		    {
+		    (void) fprintf( stderr, "%s: throughput sample period must be at least 1 ms\n", argv0 );
+		    exit( 1 );
+		    }
+		}
+	else if ( strncmp( argv[argn], "-slo", strlen( argv[argn] ) ) == 0 && argn + 1 < argc )
+		{
+		if ( sscanf( argv[++argn], "%lf,%lf,%lf", &slo_pct, &slo_ms, &slo_errors ) < 2 ||
+		     slo_pct <= 0.0 || slo_pct > 100.0 || slo_ms <= 0.0 )
+		    {
+		    (void) fprintf( stderr, "%s: slo is percentile,ms[,errors%%]\n", argv0 );
+		    exit( 1 );
+		    }
+		}
+	else if ( strncmp( argv[argn], "-slowread", strlen( argv[argn] ) ) == 0 && argn + 1 < argc )
+		{
+		slow_rate = atol( argv[++argn] );
+		if ( slow_rate < 1 )
+		    {
+		    (void) fprintf( stderr, "%s: slowread rate must be positive\n", argv0 );
+		    exit( 1 );
+		    }
+		}
+	else if ( strncmp( argv[argn], "-slowconns", strlen( argv[argn] ) ) == 0 && argn + 1 < argc )
+		{
+		slow_conns = atoi( argv[++argn] );
+		if ( slow_conns < 1 || slow_conns > MAX_CHILDREN )
+		    {
+		    (void) fprintf( stderr, "%s: slowconns must be between 1 and %d\n", argv0, MAX_CHILDREN );
+		    exit( 1 );
+		    }
+		}
+	else if ( strncmp( argv[argn], "-rcvbuf", strlen( argv[argn] ) ) == 0 && argn + 1 < argc )
+		{
+		rcvbuf = atoi( argv[++argn] );
+		}
+	else if ( timeout_option( argv[argn] ) >= 0 && argn + 1 < argc )
+		{
+		ph = timeout_option( argv[argn] );
+		to_limit[ph] = atoi( argv[++argn] );
+		if ( to_limit[ph] < 1 )
+		    {
+		    (void) fprintf( stderr, "%s: %s must be at least 1 ms\n", argv0, argv[argn - 1] );
+		    exit( 1 );
+		    }
+		}
+	else if ( strncmp( argv[argn], "-capacity", strlen( argv[argn] ) ) == 0 && argn + 1 < argc )
+		{
+		if ( sscanf( argv[++argn], "%lf,%lf,%lf", &cap_start, &cap_step, &cap_max ) != 3 ||
+		     cap_start <= 0.0 || cap_step <= 0.0 || cap_max < cap_start )
+		    {
+		    (void) fprintf( stderr, "%s: capacity is start,step,max in requests/sec\n", argv0 );
+		    exit( 1 );
+		    }
+		}
+	else if ( strncmp( argv[argn], "-capacity-search", strlen( argv[argn] ) ) == 0 && argn + 1 < argc )
+		{
+		++argn;
+		if ( strcmp( argv[argn], "step" ) == 0 )
+		    cap_binary = 0;
+		else if ( strcmp( argv[argn], "binary" ) == 0 )
+		    cap_binary = 1;
+		else
+		    usage();
+		}
+	else if ( strncmp( argv[argn], "-window", strlen( argv[argn] ) ) == 0 && argn + 1 < argc )
+		{
+		window_secs = atof( argv[++argn] );
+		if ( window_secs <= 0.0 )
+		    {
+		    (void) fprintf( stderr, "%s: window must be positive\n", argv0 );
+		    exit( 1 );
+		    }
+		}
+	else if ( strncmp( argv[argn], "-profile", strlen( argv[argn] ) ) == 0 && argn + 1 < argc )
+		{
+		profile_file = argv[++argn];
+		}
+	else if ( strncmp( argv[argn], "-replay", strlen( argv[argn] ) ) == 0 && argn + 1 < argc )
+		{
+		replay_file = argv[++argn];
+		}
+	else if ( strncmp( argv[argn], "-speed", strlen( argv[argn] ) ) == 0 && argn + 1 < argc )
+		{
+		replay_speed = atof( argv[++argn] );
+		if ( replay_speed <= 0.0 )
+		    {
+		    (void) fprintf( stderr, "%s: speed must be positive\n", argv0 );
+		    exit( 1 );
+		    }
+		}
+	else if ( strncmp( argv[argn], "-header", strlen( argv[argn] ) ) == 0 && argn + 1 < argc )
+		{
+		++argn;
+		if ( strchr( argv[argn], ':' ) == (char*) 0 || num_headers >= MAX_HEADERS )
+		    {
+		    (void) fprintf( stderr, "%s: bad or too many headers - %s\n", argv0, argv[argn] );
+		    exit( 1 );
+		    }
+		(void) tm_compile( &headers[num_headers++], argv[argn] );
+		}
+	else if ( strncmp( argv[argn], "-cache", strlen( argv[argn] ) ) == 0 )
+		{
+		do_cache = 1;
+		}
+	else if ( strncmp( argv[argn], "-conditional", strlen( argv[argn] ) ) == 0 )
+		{
+		do_cache = do_conditional = 1;
+		}
+	else if ( strncmp( argv[argn], "-backend", strlen( argv[argn] ) ) == 0 && argn + 1 < argc )
+		{
+		backend_header = argv[++argn];
+		}
+	else if ( strncmp( argv[argn], "-expect", strlen( argv[argn] ) ) == 0 && argn + 1 < argc )
+		{
+		parse_expect( argv[++argn] );
+		}
+	else if ( strncmp( argv[argn], "-body-contains", strlen( argv[argn] ) ) == 0 && argn + 1 < argc )
+		{
+		body_needle = argv[++argn];
+		if ( body_needle[0] == '\0' )
+		    usage();
+		}
+	else if ( strncmp( argv[argn], "-body-hash", strlen( argv[argn] ) ) == 0 && argn + 1 < argc )
+		{
+		body_hash_want = strtoull( argv[++argn], (char**) 0, 16 );
+		do_body_hash = 1;
+		}
+	else if ( strncmp( argv[argn], "-compress", strlen( argv[argn] ) ) == 0 && argn + 1 < argc )
+		{
+		parse_compress( argv[++argn] );
+		}
+	else if ( strncmp( argv[argn], "-follow", strlen( argv[argn] ) ) == 0 && argn + 1 < argc )
+		{
+		follow_max = atoi( argv[++argn] );
+		if ( follow_max < 1 || follow_max > MAX_HOPS )
+		    {
+		    (void) fprintf( stderr, "%s: follow must be between 1 and %d hops\n", argv0, MAX_HOPS );
+		    exit( 1 );
+		    }
+		}
+	else if ( strncmp( argv[argn], "-ab", strlen( argv[argn] ) ) == 0 && argn + 1 < argc )
+		{
+		ab_arg = argv[++argn];
+		}
+	else if ( strncmp( argv[argn], "-gate", strlen( argv[argn] ) ) == 0 && argn + 1 < argc )
+		{
+		parse_gate( argv[++argn] );
+		}
+	else if ( strncmp( argv[argn], "-gate-window", strlen( argv[argn] ) ) == 0 && argn + 1 < argc )
+		{
+		gate_window = atof( argv[++argn] );
+		if ( gate_window <= 0.0 )
+		    {
+		    (void) fprintf( stderr, "%s: gate window must be positive\n", argv0 );
+		    exit( 1 );
+		    }
+		}
+	else if ( strncmp( argv[argn], "-rolling", strlen( argv[argn] ) ) == 0 && argn + 1 < argc )
+		{
+		parse_rolling( argv[++argn] );
+		}
+	else if ( strncmp( argv[argn], "-stats-file", strlen( argv[argn] ) ) == 0 && argn + 1 < argc )
+		{
+		stats_file = argv[++argn];
+		}
+	else if ( strncmp( argv[argn], "-read-stats", strlen( argv[argn] ) ) == 0 && argn + 1 < argc )
+		{
+		read_stats( argv[++argn] );
+		exit( 0 );
+		}
+	else if ( strncmp( argv[argn], "-hist-file", strlen( argv[argn] ) ) == 0 && argn + 1 < argc )
+		{
+		hist_file = argv[++argn];
+		}
+	else if ( strncmp( argv[argn], "-merge", strlen( argv[argn] ) ) == 0 && argn + 1 < argc )
+		{
+		merge_hist_files( argc - argn - 1, &argv[argn + 1] );
+		exit( 0 );
+		}
 	else
 	    usage();
 		++argn;
@@ -247,16 +1197,91 @@ main( int argc, char** argv )
 
     /* Parse the URL. */
     parse_url();
+#ifdef USE_SSL
+    if ( probe_mode == MODE_TLS && url_protocol != PROTO_HTTPS )
+#else
+    if ( probe_mode == MODE_TLS )
+#endif
+	{
+	(void) fprintf( stderr, "%s: -mode tls needs an https url\n", argv0 );
+	exit( 1 );
+	}
+    if ( probe_mode == MODE_TCP && do_tfo )
+	{
+	(void) fprintf( stderr, "%s: -mode tcp can't be used with -tfo\n", argv0 );
+	exit( 1 );
+	}
+    if ( ( cap_max > 0.0 || profile_file != (char*) 0 || replay_file != (char*) 0 ) && slow_conns > 1 )
+	{
+	(void) fprintf( stderr, "%s: -capacity, -profile and -replay can't be used with -slowconns\n", argv0 );
+	exit( 1 );
+	}
+    if ( ab_arg != (char*) 0 && ( cap_max > 0.0 || profile_file != (char*) 0 || replay_file != (char*) 0 || slow_conns > 1 ) )
+	{
+	(void) fprintf( stderr, "%s: -ab can't be used with -capacity, -profile, -replay or -slowconns\n", argv0 );
+	exit( 1 );
+	}
+    if ( cap_max > 0.0 && ! cap_binary &&
+	 ( cap_max * 1.000001 - cap_start ) / cap_step >= MAX_CAP_STEPS )
+	{
+	(void) fprintf( stderr, "%s: -capacity step search is limited to %d rates; use a bigger step or -capacity-search binary\n", argv0, MAX_CAP_STEPS );
+	exit( 1 );
+	}
+    if ( proxy_keep && ( ! do_proxy || probe_mode != MODE_HTTP ) )
+	{
+	(void) fprintf( stderr, "%s: -proxy-keepalive needs -proxy and -mode http\n", argv0 );
+	exit( 1 );
+	}
+    if ( proxy_keep && ( cap_max > 0.0 || profile_file != (char*) 0 || replay_file != (char*) 0 || slow_conns > 1 ) )
+	{
+	(void) fprintf( stderr, "%s: -proxy-keepalive can't be used with -capacity, -profile, -replay or -slowconns\n", argv0 );
+	exit( 1 );
+	}
+    if ( ( cap_max > 0.0 ) + ( profile_file != (char*) 0 ) + ( replay_file != (char*) 0 ) > 1 )
+	{
+	(void) fprintf( stderr, "%s: only one of -capacity, -profile and -replay at a time\n", argv0 );
+	exit( 1 );
+	}
+    if ( profile_file != (char*) 0 )
+	read_profile();
+    if ( body_needle != (char*) 0 )
+	body_init();
+    /* -replay supplies its own paths. */
+    if ( replay_file == (char*) 0 && tm_compile( &url_tm, url_filename ) > 0 )
+	url_templated = 1;
 
-    /* Initialize the network stuff. */
+    /* Initialize the network stuff.  The alarm handler has to be in
+    ** place for the DNS timeout.
+    */
+#ifdef HAVE_SIGSET
+    (void) sigset( SIGALRM, handle_alarm );
+#else /* HAVE_SIGSET */
+    (void) signal( SIGALRM, handle_alarm );
+#endif /* HAVE_SIGSET */
+    timeout_start();
+    timeout_phase( TO_DNS );
+    to_startup = 1;
     init_net();
+    if ( ab_arg != (char*) 0 )
+	ab_init();
+    timeout_cancel();
+    to_startup = 0;
+    if ( slow_rate > 0 && rcvbuf == 0 )
+	rcvbuf = 4096;
+
+    if ( do_lowjitter )
+	init_lowjitter();
 
     /* Initialize the statistics. */
-    count_started = count_completed = count_failures = count_timeouts = 0;
-    total_bytes = 0;
-    min_total = min_connect = min_response = min_data = 1000000000.0;
-    max_total = max_connect = max_response = max_data = -1000000000.0;
-    sum_total = sum_connect = sum_response = sum_data = 0.0;
+    init_stats();
+    clear_stats( &tfo_stats[0] );
+    clear_stats( &tfo_stats[1] );
+    clear_stats( &proxy_stats[0] );
+    clear_stats( &proxy_stats[1] );
+    for ( ph = 0; ph < NUM_CC; ++ph )
+	clear_stats( &cache_stats[ph] );
+    clear_stats( &ab_stats[0] );
+    clear_stats( &ab_stats[1] );
 
     /* Initialize the random number generator. */
 #ifdef HAVE_SRANDOMDEV
@@ -270,98 +1295,129 @@ main( int argc, char** argv )
     (void) sigset( SIGTERM, handle_term );
     (void) sigset( SIGINT, handle_term );
     (void) sigset( SIGPIPE, SIG_IGN );
-    (void) sigset( SIGALRM, handle_alarm );
 #else /* HAVE_SIGSET */
     (void) signal( SIGTERM, handle_term );
     (void) signal( SIGINT, handle_term );
     (void) signal( SIGPIPE, SIG_IGN );
-    (void) signal( SIGALRM, handle_alarm );
 #endif /* HAVE_SIGSET */
 
     /* Main loop. */
     terminate = 0;
-    for (;;)
-	{
-	(void) setjmp( jb );
-	if ( count == 0 || terminate )
-	    break;
-	if ( count > 0 )
-	    --count;
-	++count_started;
-	alarm( timeout );
-	if ( ! start_connection() )
-	    ++count_failures;
-	else
+    (void) gettimeofday( &run_start, (struct timezone*) 0 );
+    if ( cap_max > 0.0 )
+	capacity_search();
+    else if ( num_segments > 0 )
+	run_profile();
+    else if ( replay_file != (char*) 0 )
+	run_replay();
+    else
+	for (;;)
 	    {
-	    if ( ! handle_read() )
-		++count_failures;
+	    (void) sigsetjmp( jb, 1 );
+	    if ( count == 0 || terminate )
+		break;
+	    if ( count > 0 )
+		--count;
+	    if ( slow_conns > 1 )
+		slow_round();
+	    else if ( ab_arg != (char*) 0 )
+		ab_round();
 	    else
 		{
-		++count_completed;
-		elapsed_total =
-		    delta_timeval( &started_at, &finished_at ) / 1000.0;
-		elapsed_connect =
-		    delta_timeval( &started_at, &connect_at ) / 1000.0;
-		elapsed_response =
-		    delta_timeval( &connect_at, &response_at ) / 1000.0;
-		elapsed_data =
-		    delta_timeval( &response_at, &finished_at ) / 1000.0;
-		if ( ! quiet )
-		    (void) printf(
-			"%ld bytes from %s: %g ms (%gc/%gr/%gd)\n",
-			bytes, url, elapsed_total, elapsed_connect,
-			elapsed_response, elapsed_data );
-		min_total = min( min_total, elapsed_total );
-		min_connect = min( min_connect, elapsed_connect );
-		min_response = min( min_response, elapsed_response );
-		min_data = min( min_data, elapsed_data );
-		max_total = max( max_total, elapsed_total );
-		max_connect = max( max_connect, elapsed_connect );
-		max_response = max( max_response, elapsed_response );
-		max_data = max( max_data, elapsed_data );
-		sum_total += elapsed_total;
-		sum_connect += elapsed_connect;
-		sum_response += elapsed_response;
-		sum_data += elapsed_data;
+		probe_started();
+		timeout_start();
+		timeout_phase( TO_CONNECT );
+		ok = fetch_probe();
+		timeout_cancel();
+		if ( ok )
+		    probe_succeeded();
+		else
+		    probe_failed();
 		}
+	    if ( count == 0 || terminate )
+		break;
+	    if ( interval > 0.0 )
+		    idle_secs( interval );
 	    }
-	alarm( 0 );
-	if ( count == 0 || terminate )
-	    break;
-	if ( interval )
-		sleep( interval );
-	}
 
     /* Report statistics. */
+    roll_finish();
+    if ( hop_moved )
+	follow_restore();
+    if ( ab_arg != (char*) 0 )
+	ab_use( 0 );
     (void) printf( "\n" );
     (void) printf( "--- %s %s %s http_ping statistics ---\n", method, vhost, url );
-    (void) printf(
-	"%d requests started, %d completed (%d%%), %d failures (%d%%), %d timeouts (%d%%)\n",
-	count_started, count_completed, count_completed * 100 / count_started,
-	count_failures, count_failures * 100 / count_started,
-	count_timeouts, count_timeouts * 100 / count_started );
-    if ( count_completed > 0 )
-	{
-	(void) printf(
-	    "total    min/avg/max = %g/%g/%g ms\n",
-	    min_total, sum_total / count_completed, max_total );
-	(void) printf(
-	    "connect  min/avg/max = %g/%g/%g ms\n",
-	    min_connect, sum_connect / count_completed, max_connect );
-	(void) printf(
-	    "response min/avg/max = %g/%g/%g ms\n",
-	    min_response, sum_response / count_completed, max_response );
+    report_stats( st, 0 );
+    if ( kid_overflows > 0 )
 	(void) printf(
-	    "data     min/avg/max = %g/%g/%g ms\n",
-	    min_data, sum_data / count_completed, max_data );
+	    "%d probes not sent, %d were already running\n", kid_overflows,
+	    MAX_CHILDREN );
+    if ( do_tfo )
+	{
+	report_group( &tfo_stats[1], "tfo (data in SYN)" );
+	report_group( &tfo_stats[0], "no tfo" );
+	}
+    if ( proxy_keep )
+	{
+	report_group( &proxy_stats[0], "new proxy connection" );
+	report_group( &proxy_stats[1], "reused proxy connection" );
+	}
+    if ( do_cache )
+	{
+	(void) printf(
+	    "cache: %d hits, %d misses, %d revalidated, %d unknown",
+	    cache_stats[CC_HIT].completed, cache_stats[CC_MISS].completed,
+	    cache_stats[CC_REVALIDATED].completed,
+	    cache_stats[CC_UNKNOWN].completed );
+	if ( st->completed > 0 )
+	    (void) printf(
+		" (%d%% served from cache)",
+		( cache_stats[CC_HIT].completed +
+		  cache_stats[CC_REVALIDATED].completed ) * 100 /
+		st->completed );
+	(void) printf( "\n" );
+	for ( ph = 1; ph < NUM_CC; ++ph )
+	    if ( cache_stats[ph].completed > 0 )
+		report_group( &cache_stats[ph], cc_names[ph] );
+	}
+    if ( cap_max > 0.0 )
+	capacity_report();
+    if ( num_segments > 0 )
+	profile_report();
+    if ( backend_header != (char*) 0 )
+	report_keys( &backends, backend_header );
+    if ( ab_arg != (char*) 0 )
+	ab_report();
+    if ( replay_file != (char*) 0 )
+	{
+	if ( replay_bad_lines > 0 )
+	    (void) printf( "%d trace lines skipped\n", replay_bad_lines );
+	report_keys( &replay_paths, "path" );
 	}
+    if ( do_lowjitter && wakeup_blocking > 0.0 )
+	(void) printf(
+	    "lowjitter: loopback wakeup %g us blocking, %g us spinning, ~%g us removed per read\n",
+	    wakeup_blocking, wakeup_spinning,
+	    max( wakeup_blocking - wakeup_spinning, 0.0 ) );
+
+    /* The verdict decides the exit status: the first failed -gate's, or
+    ** like ping, 1 if nothing got through at all.
+    */
+    status = gate_report();
+    if ( status == 0 && st->started > 0 && st->completed == 0 )
+	status = 1;
+    if ( hist_file != (char*) 0 )
+	write_hist_file( hist_file, st );
 
     /* Done. */
 #ifdef USE_SSL
     if ( ssl_ctx != (SSL_CTX*) 0 )
 	SSL_CTX_free( ssl_ctx );
 #endif
-    exit( 0 );
+    if ( stats_file != (char*) 0 )
+	(void) munmap( (void*) shm, sizeof(stats_shm) );
+    exit( status );
     }
 
 
@@ -369,488 +1425,2928 @@ static void
 usage( void )
     {
     (void) fprintf( stderr,
-    		"usage:  %s [-count n] [-interval n] [-nagle] [-quiet] [-proxy host:port] [-method http_method] [-vhost vhost] url\n", argv0 );
+    		"usage:  %s [-count n] [-interval n] [-timeout secs] [-dns|connect|tls|ttfb|idle-timeout ms] [-nagle] [-quiet] [-proxy host:port] [-proxy-keepalive] [-method http_method] [-vhost vhost] [-tcpinfo] [-timestamps] [-lowjitter] [-cpu n] [-rtprio n] [-bind addr,...] [-linger0] [-tfo] [-mode http|tcp|tls] [-throughput ms] [-slowread bytes/sec] [-slowconns n] [-rcvbuf bytes] [-capacity start,step,max] [-capacity-search step|binary] [-window secs] [-slo pct,ms,errors%%] [-profile file] [-replay file] [-speed factor] [-header name:value] [-cache] [-conditional] [-backend header] [-expect codes] [-body-contains string] [-body-hash hex] [-compress gzip,deflate,br] [-follow hops] [-ab url|vhost] [-gate threshold] [-gate-window secs] [-rolling secs,...] [-stats-file file] [-hist-file file] url\n", argv0 );
+    (void) fprintf( stderr,
+    		"        %s -read-stats file\n", argv0 );
+    (void) fprintf( stderr,
+    		"        %s -merge file ...\n", argv0 );
     exit( 1 );
     }
 
-static void
-parse_request_file( void )
-	{
-		/* TODO */
-	}
 
+/* Prints and records a probe that completed, from the per-probe globals. */
 static void
-parse_url( void )
+probe_succeeded( void )
     {
-    char* http = "http://";
-    int http_len = strlen( http );
-#ifdef USE_SSL
-    char* https = "https://";
-    int https_len = strlen( https );
-#endif
-    int proto_len, host_len;
-    char* cp;
+    long long elapsed[NUM_PHASES];
+    int ti;
+    probe_stats* be;
+    char* why;
 
-    if ( strncmp( http, url, http_len ) == 0 )
+    /* A response that arrived but isn't what we wanted isn't a success. */
+    if ( probe_mode == MODE_HTTP && ( why = validate_probe() ) != (char*) 0 )
 	{
-	proto_len = http_len;
-	url_protocol = PROTO_HTTP;
+	probe_invalid( why );
+	return;
 	}
-#ifdef USE_SSL
-    else if ( strncmp( https, url, https_len ) == 0 )
+
+    /* With -follow the phases are the last hop's, the total the chain's. */
+    elapsed[PH_TOTAL] =
+	delta_timeval( &started_at, &finished_at ) + redirect_usecs;
+    elapsed[PH_CONNECT] = delta_timeval( &started_at, &connect_at );
+    elapsed[PH_RESPONSE] = delta_timeval( &connect_at, &response_at );
+    elapsed[PH_DATA] = delta_timeval( &response_at, &finished_at );
+    if ( ! quiet && probe_mode == MODE_TCP )
+	(void) printf(
+	    "connected to %s: %g ms\n", url, elapsed[PH_TOTAL] / 1000.0 );
+    else if ( ! quiet && probe_mode == MODE_TLS )
+	(void) printf(
+	    "handshake with %s: %g ms (%g ms tcp connect)\n", url,
+	    elapsed[PH_TOTAL] / 1000.0,
+	    delta_timeval( &started_at, &tcp_at ) / 1000.0 );
+    else if ( ! quiet )
 	{
-	proto_len = https_len;
-	url_protocol = PROTO_HTTPS;
+	(void) printf(
+	    "%ld bytes from %s: %g ms (%gc/%gr/%gd)",
+	    bytes, url, elapsed[PH_TOTAL] / 1000.0,
+	    elapsed[PH_CONNECT] / 1000.0, elapsed[PH_RESPONSE] / 1000.0,
+	    elapsed[PH_DATA] / 1000.0 );
+	if ( ab_arg != (char*) 0 )
+	    (void) printf( " [%c]", "AB"[ab_side] );
+	if ( do_tcpinfo && got_tcp_info )
+	    (void) printf(
+		" tcp rtt %g/%g ms, %g retrans (%u connect), %g lost, cwnd %g, %g Mbit/s, server ~%g ms",
+		ti_values[TI_RTT], ti_values[TI_MIN_RTT],
+		ti_values[TI_RETRANS], ti_connect_retrans,
+		ti_values[TI_LOST], ti_values[TI_CWND],
+		ti_values[TI_RATE],
+		max( elapsed[PH_RESPONSE] / 1000.0 - ti_values[TI_RTT], 0.0 ) );
+	if ( got_tx_ts && got_rx_ts )
+	    (void) printf(
+		" wire %g ms%s (app %g ms)", wire_latency(),
+		got_tx_hw && got_rx_hw ? " hw" : "",
+		delta_timeval( &sent_at, &response_at ) / 1000.0 );
+	if ( do_tfo )
+	    (void) printf( tfo_accepted ? " tfo" : " no-tfo" );
+	if ( conn_reused )
+	    (void) printf( " proxy reused" );
+	else if ( tunnelled )
+	    (void) printf(
+		" proxy %g ms, tunnel %g ms, tls %g ms",
+		delta_timeval( &started_at, &tcp_at ) / 1000.0,
+		delta_timeval( &tcp_at, &tunnel_at ) / 1000.0,
+		delta_timeval( &tunnel_at, &connect_at ) / 1000.0 );
+	if ( num_hops > 0 )
+	    {
+	    (void) printf( " after %d redirect%s (", num_hops, num_hops == 1 ? "" : "s" );
+	    for ( ti = 0; ti < num_hops; ++ti )
+		(void) printf(
+		    "%s%d %g ms", ti > 0 ? ", " : "", hop_status[ti],
+		    hop_usecs[ti] / 1000.0 );
+	    if ( num_reused > 0 )
+		(void) printf(
+		    "; %d connection%s reused", num_reused,
+		    num_reused == 1 ? "" : "s" );
+	    (void) printf( ")" );
+	    }
+	if ( accept_encoding != (char*) 0 && dec_started && bytes > 0 )
+	    (void) printf(
+		" %s %lld decoded (%gx) in %g ms", enc_names[resp_encoding],
+		dec_bytes, (double) dec_bytes / bytes, dec_usecs / 1000.0 );
+	else if ( accept_encoding != (char*) 0 )
+	    (void) printf( " %s", enc_names[resp_encoding] );
+	if ( do_cache )
+	    {
+	    (void) printf( " cache %s", cc_names[cache_class] );
+	    if ( resp_age >= 0 )
+		(void) printf( " (age %ld)", resp_age );
+	    }
+	if ( tp_period > 0 && tp_started && elapsed[PH_DATA] > 0 )
+	    {
+	    (void) printf(
+		" tp %g MB/s", (double) bytes / elapsed[PH_DATA] );
+	    if ( tp_slots > 0 )
+		(void) printf(
+		    " (%d x %d ms: min %g p50 %g MB/s, %d stalls)",
+		    tp_slots, tp_period, tp_min_rate / 1000.0,
+		    hist_percentile( &tp_probe_hist, 50.0 ) / 1000.0,
+		    tp_stalls );
+	    if ( bytes >= TP_FIRST_MB )
+		(void) printf(
+		    " first MB %g ms",
+		    delta_timeval( &started_at, &tp_first_mb_at ) / 1000.0 );
+	    }
+	(void) printf( "\n" );
 	}
-#endif
-    else
+    stats_begin();
+    record_probe( st, elapsed, bytes );
+    if ( tp_period > 0 && tp_started )
+	tp_record( st, elapsed[PH_DATA] );
+    if ( accept_encoding != (char*) 0 )
+	dec_record( st );
+    if ( tunnelled && ! conn_reused )
 	{
-	(void) fprintf( stderr, "%s: unknown protocol - %s\n", argv0, url );
-	exit( 1 );
+	accum_add( &st->proxy_ms, delta_timeval( &started_at, &tcp_at ) / 1000.0 );
+	accum_add( &st->tunnel_ms, delta_timeval( &tcp_at, &tunnel_at ) / 1000.0 );
+	accum_add( &st->tls_ms, delta_timeval( &tunnel_at, &connect_at ) / 1000.0 );
 	}
-    for ( cp = url + proto_len;
-	 *cp != '\0' && *cp != ':' && *cp != '/'; ++cp )
-	;
-    host_len = cp - url;
-    host_len -= proto_len;
-    host_len = min( host_len, sizeof(url_host) - 1 );
-    strncpy( url_host, url + proto_len, host_len );
-    url_host[host_len] = '\0';
-    if ( *cp == ':' )
+    if ( follow_max > 0 )
 	{
-	url_port = (unsigned short) atoi( ++cp );
-	while ( *cp != '\0' && *cp != '/' )
-	    ++cp;
+	accum_add( &st->hops, num_hops );
+	if ( num_hops > 0 )
+	    accum_add( &st->redirect_ms, redirect_usecs / 1000.0 );
 	}
-    else
-#ifdef USE_SSL
-	if ( url_protocol == PROTO_HTTPS )
-	    url_port = 443;
-	else
-	    url_port = 80;
-#else
-	url_port = 80;
-#endif
-    if ( *cp == '\0' )
-	url_filename = "/";
-    else
-	url_filename = cp;
+    if ( do_tcpinfo && got_tcp_info )
+	for ( ti = 0; ti < NUM_TI; ++ti )
+	    accum_add( &st->ti[ti], ti_values[ti] );
+    if ( got_tx_ts && got_rx_ts )
+	{
+	accum_add( &st->wire, wire_latency() );
+	accum_add(
+	    &st->app_noise,
+	    delta_timeval( &sent_at, &response_at ) / 1000.0 -
+	    wire_latency() );
+	}
+    stats_end();
+    if ( do_tfo )
+	record_probe( &tfo_stats[tfo_accepted], elapsed, bytes );
+    if ( proxy_keep )
+	record_probe( &proxy_stats[conn_reused], elapsed, bytes );
+    if ( group_stats != (probe_stats*) 0 )
+	record_probe( group_stats, elapsed, bytes );
+    if ( do_cache )
+	record_probe( &cache_stats[cache_class], elapsed, bytes );
+    if ( ( be = probe_backend() ) != (probe_stats*) 0 )
+	{
+	++be->started;
+	record_probe( be, elapsed, bytes );
+	}
+    if ( ab_arg != (char*) 0 )
+	ab_sample( elapsed[PH_TOTAL] / 1000.0 );
+
+    /* The next -conditional request revalidates what this one got. */
+    if ( resp_etag[0] != '\0' )
+	(void) strcpy( cond_etag, resp_etag );
+    if ( resp_last_modified[0] != '\0' )
+	(void) strcpy( cond_last_modified, resp_last_modified );
     }
 
 
 static void
-init_net( void )
+probe_started( void )
     {
-    char* host;
+    if ( num_gates > 0 )
+	gate_tick();
+    if ( num_roll_windows > 0 )
+	roll_tick();
+    ++probe_seq;
+    stats_begin();
+    ++st->started;
+    stats_end();
+    if ( group_stats != (probe_stats*) 0 )
+	++group_stats->started;
+    }
 
-    if ( do_proxy )
-	{
-	host = proxy_host;
-	port = proxy_port;
-	}
-    else
+
+static void
+probe_failed( void )
+    {
+    probe_stats* be;
+
+    stats_begin();
+    ++st->failures;
+    stats_end();
+    if ( group_stats != (probe_stats*) 0 )
+	++group_stats->failures;
+    if ( ( be = probe_backend() ) != (probe_stats*) 0 )
 	{
-	host = url_host;
-	port = url_port;
+	++be->started;
+	++be->failures;
 	}
-    lookup_address( host, port );
     }
 
 
-static int
-start_connection( void )
+static void
+probe_timed_out( int phase )
     {
-    char buf[600];
-    int b, r;
-
-    (void) gettimeofday( &started_at, (struct timezone*) 0 );
-    got_response = 0;
-    content_length = -1;
-    bytes = 0;
-
-    conn_fd = open_client_socket();
-    if ( conn_fd < 0 )
-	return 0;
+    probe_stats* be;
 
-#ifdef USE_SSL
-    if ( url_protocol == PROTO_HTTPS )
+    stats_begin();
+    ++st->timeouts;
+    ++st->phase_timeouts[phase];
+    stats_end();
+    if ( group_stats != (probe_stats*) 0 )
 	{
-	/* Complete the SSL connection. */
-	if ( ssl_ctx == (SSL_CTX*) 0 )
-	    {
-	    SSL_load_error_strings();
-	    SSLeay_add_ssl_algorithms();
-	    ssl_ctx = SSL_CTX_new( SSLv23_client_method() );
-	    }
-	if ( ! RAND_status() )
-	    {
-	    unsigned char rb[1024];
-	    int i;
-	    for ( i = 0; i < sizeof(rb); ++i )
-		rb[i] = random() % 0xff;
-	    RAND_seed( rb, sizeof(rb) );
-	    }
-	ssl = SSL_new( ssl_ctx );
-	SSL_set_fd( ssl, conn_fd );
-	r = SSL_connect( ssl );
-	if ( r <= 0 )
-	    {
-	    (void) fprintf(
-		stderr, "%s: SSL connection failed - %d\n", argv0, r );
-	    ERR_print_errors_fp( stderr );
-	    close_connection();
-	    return 0;
-	    }
+	++group_stats->timeouts;
+	++group_stats->phase_timeouts[phase];
 	}
-#endif
-    (void) gettimeofday( &connect_at, (struct timezone*) 0 );
-
-    /* Format the request. */
-    if ( do_proxy )
+    if ( ( be = probe_backend() ) != (probe_stats*) 0 )
 	{
-#ifdef USE_SSL
-	b = snprintf(
-	    buf, sizeof(buf), "GET %s://%.500s:%d%.500s HTTP/1.0\r\n",
-	    url_protocol == PROTO_HTTPS ? "https" : "http", url_host,
-	    (int) url_port, url_filename );
-#else
-	b = snprintf(
-	    buf, sizeof(buf), "GET http://%.500s:%d%.500s HTTP/1.0\r\n",
-	    url_host, (int) url_port, url_filename );
-#endif
+	++be->started;
+	++be->timeouts;
+	++be->phase_timeouts[phase];
 	}
-    else
-	b = snprintf(
-	    buf, sizeof(buf), "%s %.500s HTTP/1.1\r\n", method ? method : "GET", url_filename );
-    b += snprintf( &buf[b], sizeof(buf) - b, "Host: %s\r\n", vhost ? vhost : url_host );
-    b += snprintf( &buf[b], sizeof(buf) - b, "User-Agent: http_ping\r\n" );
-    b += snprintf( &buf[b], sizeof(buf) - b, "Connection: Close\r\n\r\n" );
+    }
 
-    /* Send the request. */
-#ifdef USE_SSL
-    if ( url_protocol == PROTO_HTTPS )
-	r = SSL_write( ssl, buf, b );
-    else
-	r = write( conn_fd, buf, b );
-#else
-    r = write( conn_fd, buf, b );
-#endif
-    if ( r < 0 )
+
+static void
+probe_invalid( char* why )
+    {
+    probe_stats* be;
+
+    (void) fprintf( stderr, "%s: %s\n", url, why );
+    stats_begin();
+    ++st->invalid;
+    stats_end();
+    if ( group_stats != (probe_stats*) 0 )
+	++group_stats->invalid;
+    if ( ( be = probe_backend() ) != (probe_stats*) 0 )
 	{
-	perror( "write" );
-	close_connection();
-	return 0;
+	++be->started;
+	++be->invalid;
 	}
-    conn_state = ST_BOL;
-    return 1;
     }
 
 
-#if defined(AF_INET6) && defined(IN6_IS_ADDR_V4MAPPED)
-#define USE_IPV6
-#endif
+/* Returns why the response doesn't pass, or 0 if it does. */
+static char*
+validate_probe( void )
+    {
+    static char why[100];
 
-#ifdef USE_IPV6
-static struct sockaddr_in6 sa;
-#else /* USE_IPV6 */
-static struct sockaddr_in sa;
-#endif /* USE_IPV6 */
-static int sa_len, sock_family, sock_type, sock_protocol;
+    if ( hop_overflow )
+	return "too many redirects";
+    if ( resp_status <= 0 || resp_status >= MAX_STATUS || ! expect_ok[resp_status] )
+	{
+	(void) snprintf( why, sizeof(why), "unexpected status %d", resp_status );
+	return why;
+	}
+    if ( dec_failed )
+	return "body could not be decoded";
+    if ( dec_started && ! dec_done )
+	return "compressed body was cut short";
+    if ( body_needle != (char*) 0 && ! body_found )
+	return "body check failed - string not found";
+    if ( do_body_hash && body_hash != body_hash_want )
+	{
+	(void) snprintf(
+	    why, sizeof(why), "body check failed - hash %016llx", body_hash );
+	return why;
+	}
+    return (char*) 0;
+    }
 
 
+/* Sets the acceptable status codes from a list like 200,204,300-399
+** or 2xx,3xx; "any" accepts everything.
+*/
 static void
-lookup_address( char* hostname, unsigned short port )
+parse_expect( char* codes )
     {
-#ifdef USE_IPV6
-    struct addrinfo hints;
-    char portstr[10];
-    int gaierr;
-    struct addrinfo* ai;
-    struct addrinfo* ai2;
-    struct addrinfo* aiv4;
-    struct addrinfo* aiv6;
-#else /* USE_IPV6 */
-    struct hostent *he;
-#endif /* USE_IPV6 */
+    char* cp;
+    int lo, hi, c;
 
-    (void) memset( (void*) &sa, 0, sizeof(sa) );
+    (void) memset( (void*) expect_ok, 0, sizeof(expect_ok) );
+    if ( strcmp( codes, "any" ) == 0 )
+	{
+	(void) memset( (void*) expect_ok, 1, sizeof(expect_ok) );
+	return;
+	}
+    for ( cp = codes; *cp != '\0'; cp += strcspn( cp, "," ), cp += ( *cp == ',' ) )
+	{
+	if ( isdigit( (unsigned char) cp[0] ) && ( cp[1] == 'x' || cp[1] == 'X' ) )
+	    {
+	    lo = ( cp[0] - '0' ) * 100;
+	    hi = lo + 99;
+	    }
+	else if ( sscanf( cp, "%d-%d", &lo, &hi ) == 2 )
+	    ;
+	else if ( sscanf( cp, "%d", &lo ) == 1 )
+	    hi = lo;
+	else
+	    lo = hi = -1;
+	if ( lo < 100 || hi >= MAX_STATUS || hi < lo )
+	    {
+	    (void) fprintf( stderr, "%s: bad status codes - %s\n", argv0, codes );
+	    exit( 1 );
+	    }
+	for ( c = lo; c <= hi; ++c )
+	    expect_ok[c] = 1;
+	}
+    }
 
-#ifdef USE_IPV6
 
-    (void) memset( &hints, 0, sizeof(hints) );
-    hints.ai_family = PF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-    (void) snprintf( portstr, sizeof(portstr), "%d", (int) port );
-    if ( (gaierr = getaddrinfo( hostname, portstr, &hints, &ai )) != 0 )
+/* Sets the Accept-Encoding for -compress, checking that this build can
+** decode everything in the list.
+*/
+static void
+parse_compress( char* list )
+    {
+    char* cp;
+    int n;
+
+    for ( cp = list; *cp != '\0'; cp += n, cp += ( *cp == ',' ) )
 	{
+	n = strcspn( cp, "," );
+#ifdef USE_ZLIB
+	if ( ( n == 4 && strncmp( cp, "gzip", n ) == 0 ) ||
+	     ( n == 7 && strncmp( cp, "deflate", n ) == 0 ) )
+	    continue;
+#endif
+#ifdef USE_BROTLI
+	if ( n == 2 && strncmp( cp, "br", n ) == 0 )
+	    continue;
+#endif
 	(void) fprintf(
-	    stderr, "%s: getaddrinfo %s - %s\n", argv0, hostname,
-	    gai_strerror( gaierr ) );
+	    stderr, "%s: can't decode %.*s in this build\n", argv0, n, cp );
 	exit( 1 );
 	}
+    accept_encoding = list;
+    }
 
-    /* Find the first IPv4 and IPv6 entries. */
-    aiv4 = (struct addrinfo*) 0;
-    aiv6 = (struct addrinfo*) 0;
-    for ( ai2 = ai; ai2 != (struct addrinfo*) 0; ai2 = ai2->ai_next )
+
+/* Takes body bytes as they come off the wire and passes the content on
+** to body_decode(), without the framing if the body is chunked.
+*/
+static void
+body_data( char* p, int n )
+    {
+    int k;
+    char c;
+
+    if ( ! resp_chunked )
 	{
-	switch ( ai2->ai_family )
+	body_decode( p, n );
+	return;
+	}
+    while ( n > 0 )
+	{
+	if ( chunk_state == CK_DATA )
 	    {
-	    case AF_INET: 
-	    if ( aiv4 == (struct addrinfo*) 0 )
-		aiv4 = ai2;
+	    k = min( n, chunk_left );
+	    body_decode( p, k );
+	    p += k;
+	    n -= k;
+	    chunk_left -= k;
+	    if ( chunk_left == 0 )
+		chunk_state = CK_END;
+	    continue;
+	    }
+	c = *p++;
+	--n;
+	switch ( chunk_state )
+	    {
+	    case CK_SIZE:
+	    if ( isxdigit( (unsigned char) c ) )
+		{
+		chunk_left = chunk_left * 16 +
+		    ( isdigit( (unsigned char) c ) ? c - '0' : tolower( (unsigned char) c ) - 'a' + 10 );
+		break;
+		}
+	    chunk_state = CK_EXT;
+	    /* fall through */
+	    case CK_EXT:
+	    if ( c == '\n' )
+		chunk_state = chunk_left > 0 ? CK_DATA : CK_TRAILER;
 	    break;
-	    case AF_INET6:
-	    if ( aiv6 == (struct addrinfo*) 0 )
-		aiv6 = ai2;
+
+	    case CK_END:
+	    if ( c == '\n' )
+		{
+		chunk_state = CK_SIZE;
+		chunk_left = 0;
+		}
+	    break;
+
+	    /* Trailer lines, up to the empty one that ends the body. */
+	    case CK_TRAILER:
+	    if ( c == '\n' )
+		chunk_state = CK_DONE;
+	    else if ( c != '\r' )
+		chunk_state = CK_TRAILER_TEXT;
+	    break;
+
+	    case CK_TRAILER_TEXT:
+	    if ( c == '\n' )
+		chunk_state = CK_TRAILER;
+	    break;
+
+	    case CK_DONE:
 	    break;
 	    }
 	}
+    }
 
-    /* If there's an IPv4 address, use that, otherwise try IPv6. */
-    if ( aiv4 != (struct addrinfo*) 0 )
+
+/* Decodes body content per the Content-Encoding and hands the result to
+** the body checks.
+*/
+static void
+body_decode( char* p, int n )
+    {
+    struct timeval t0, t1;
+
+    if ( resp_encoding == ENC_IDENTITY )
 	{
-	if ( sizeof(sa) < aiv4->ai_addrlen )
-	    {
-	    (void) fprintf(
-		stderr, "%s - sockaddr too small (%lu < %lu)\n",
-		hostname, (unsigned long) sizeof(sa),
-		(unsigned long) aiv4->ai_addrlen );
-	    exit( 1 );
-	    }
-	sock_family = aiv4->ai_family;
-	sock_type = aiv4->ai_socktype;
-	sock_protocol = aiv4->ai_protocol;
-	sa_len = aiv4->ai_addrlen;
-	(void) memmove( &sa, aiv4->ai_addr, sa_len );
-	freeaddrinfo( ai );
+	body_feed( p, n );
 	return;
 	}
-    if ( aiv6 != (struct addrinfo*) 0 )
+    if ( dec_failed || dec_done || n <= 0 )
+	return;
+    (void) gettimeofday( &t0, (struct timezone*) 0 );
+    switch ( resp_encoding )
 	{
-	if ( sizeof(sa) < aiv6->ai_addrlen )
+#ifdef USE_ZLIB
+	case ENC_GZIP:
+	case ENC_DEFLATE:
+	{
+	int r, k;
+
+	if ( ! dec_started )
 	    {
-	    (void) fprintf(
-		stderr, "%s - sockaddr too small (%lu < %lu)\n",
-		hostname, (unsigned long) sizeof(sa),
-		(unsigned long) aiv6->ai_addrlen );
-	    exit( 1 );
+	    /* 32 more window bits has zlib take either a zlib or a gzip
+	    ** header.
+	    */
+	    if ( ! dec_z_ready )
+		dec_z_ready = inflateInit2( &dec_z, MAX_WBITS + 32 ) == Z_OK;
+	    else
+		(void) inflateReset( &dec_z );
+	    if ( ! dec_z_ready )
+		{
+		dec_failed = 1;
+		break;
+		}
 	    }
-	sock_family = aiv6->ai_family;
-	sock_type = aiv6->ai_socktype;
-	sock_protocol = aiv6->ai_protocol;
-	sa_len = aiv6->ai_addrlen;
-	(void) memmove( &sa, aiv6->ai_addr, sa_len );
-	freeaddrinfo( ai );
-	return;
+	dec_started = 1;
+	dec_z.next_in = (Bytef*) p;
+	dec_z.avail_in = n;
+	do
+	    {
+	    dec_z.next_out = (Bytef*) dec_buf;
+	    dec_z.avail_out = sizeof(dec_buf);
+	    r = inflate( &dec_z, Z_NO_FLUSH );
+	    if ( r != Z_OK && r != Z_STREAM_END && r != Z_BUF_ERROR )
+		{
+		dec_failed = 1;
+		break;
+		}
+	    k = sizeof(dec_buf) - dec_z.avail_out;
+	    dec_bytes += k;
+	    body_feed( dec_buf, k );
+	    if ( r == Z_STREAM_END )
+		dec_done = 1;
+	    }
+	while ( r == Z_OK && dec_z.avail_out == 0 );
+	break;
 	}
+#endif /* USE_ZLIB */
 
-    (void) fprintf(
-	stderr, "%s: no valid address found for host %s\n", argv0, hostname );
-    exit( 1 );
+#ifdef USE_BROTLI
+	case ENC_BR:
+	{
+	BrotliDecoderResult r;
+	int k;
+	size_t avail_in, avail_out;
+	const uint8_t* next_in;
+	uint8_t* next_out;
 
-#else /* USE_IPV6 */
+	if ( ! dec_started )
+	    dec_br = BrotliDecoderCreateInstance( 0, 0, 0 );
+	dec_started = 1;
+	if ( dec_br == (BrotliDecoderState*) 0 )
+	    {
+	    dec_failed = 1;
+	    break;
+	    }
+	avail_in = n;
+	next_in = (const uint8_t*) p;
+	do
+	    {
+	    avail_out = sizeof(dec_buf);
+	    next_out = (uint8_t*) dec_buf;
+	    r = BrotliDecoderDecompressStream(
+		dec_br, &avail_in, &next_in, &avail_out, &next_out, 0 );
+	    if ( r == BROTLI_DECODER_RESULT_ERROR )
+		{
+		dec_failed = 1;
+		break;
+		}
+	    k = sizeof(dec_buf) - avail_out;
+	    dec_bytes += k;
+	    body_feed( dec_buf, k );
+	    if ( r == BROTLI_DECODER_RESULT_SUCCESS )
+		dec_done = 1;
+	    }
+	while ( r == BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT );
+	break;
+	}
+#endif /* USE_BROTLI */
 
-    he = gethostbyname( hostname );
-    if ( he == (struct hostent*) 0 )
-	{
-	(void) fprintf( stderr, "%s: unknown host - %s\n", argv0, hostname );
-	exit( 1 );
+	default:
+	/* An encoding we didn't ask for. */
+	dec_started = 1;
+	dec_failed = 1;
+	break;
 	}
-    sock_family = sa.sin_family = he->h_addrtype;
-    sock_type = SOCK_STREAM;
-    sock_protocol = 0;
-    sa_len = sizeof(sa);
-    (void) memmove( &sa.sin_addr, he->h_addr, he->h_length );
-    sa.sin_port = htons( port );
+    (void) gettimeofday( &t1, (struct timezone*) 0 );
+    dec_usecs += delta_timeval( &t0, &t1 );
+    }
 
-#endif /* USE_IPV6 */
 
+/* Adds this probe's -compress numbers to s. */
+static void
+dec_record( probe_stats* s )
+    {
+    ++s->enc_count[resp_encoding];
+    if ( ! dec_started || bytes <= 0 )
+	return;
+    s->dec_wire += bytes;
+    s->dec_bytes += dec_bytes;
+    accum_add( &s->dec_ratio, (double) dec_bytes / bytes );
+    accum_add( &s->dec_ms, dec_usecs / 1000.0 );
     }
 
 
-static int
-open_client_socket( void )
+/* Builds the KMP failure table for -body-contains. */
+static void
+body_init( void )
     {
-    int sockfd;
-    int flag = 1;
+    int i, k;
 
-    sockfd = socket( sock_family, sock_type, sock_protocol );
-    if ( sockfd < 0 )
+    body_needle_len = strlen( body_needle );
+    body_fail = (int*) malloc( body_needle_len * sizeof(int) );
+    if ( body_fail == (int*) 0 )
 	{
-	perror( "socket" );
-	return -1;
+	(void) fprintf( stderr, "%s: out of memory\n", argv0 );
+	exit( 1 );
+	}
+    body_fail[0] = 0;
+    for ( i = 1, k = 0; i < body_needle_len; ++i )
+	{
+	while ( k > 0 && body_needle[i] != body_needle[k] )
+	    k = body_fail[k - 1];
+	if ( body_needle[i] == body_needle[k] )
+	    ++k;
+	body_fail[i] = k;
 	}
+    }
 
-    if (!nagle)
-    	{
-		if (setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, (char*)&flag, sizeof flag) <0)
-			{
-			perror( "TCP_NODELAY" );
-			return -1;
-			}
-    	}
 
-    if ( connect( sockfd, (struct sockaddr*) &sa, sa_len ) < 0 )
+/* Runs the body checks over the next n bytes of the body. */
+static void
+body_feed( char* p, int n )
+    {
+    int i;
+    unsigned long long h;
+
+    if ( do_body_hash )
 	{
-	perror( "connect" );
-	(void) close( sockfd );
-	return -1;
+	h = body_hash;
+	for ( i = 0; i < n; ++i )
+	    h = ( h ^ (unsigned char) p[i] ) * 1099511628211ULL;
+	body_hash = h;
 	}
+    if ( body_needle != (char*) 0 && ! body_found )
+	for ( i = 0; i < n; ++i )
+	    {
+	    while ( body_match > 0 && p[i] != body_needle[body_match] )
+		body_match = body_fail[body_match - 1];
+	    if ( p[i] == body_needle[body_match] )
+		++body_match;
+	    if ( body_match == body_needle_len )
+		{
+		body_found = 1;
+		break;
+		}
+	    }
+    }
 
-    return sockfd;
+
+/* This probe's -backend statistics, under "(no header)" if it didn't
+** get as far as the header or there wasn't one.
+*/
+static probe_stats*
+probe_backend( void )
+    {
+    if ( backend_header == (char*) 0 )
+	return (probe_stats*) 0;
+    if ( resp_backend == (probe_stats*) 0 )
+	resp_backend = key_lookup(
+	    &backends, "(no header)", strlen( "(no header)" ), (char**) 0 );
+    return resp_backend;
     }
 
 
-static int
-handle_read( void )
+static void
+init_stats( void )
     {
-    char buf[5000];
-    int bytes_to_read, bytes_read, bytes_handled;
+    int fd;
 
-    for (;;)
+    if ( stats_file != (char*) 0 )
 	{
-	bytes_to_read = sizeof(buf);
-#ifdef USE_SSL
-	if ( url_protocol == PROTO_HTTPS )
-	    bytes_read = SSL_read( ssl, buf, bytes_to_read );
-	else
-	    bytes_read = read( conn_fd, buf, bytes_to_read );
-#else
-	bytes_read = read( conn_fd, buf, bytes_to_read );
-#endif
-	if ( bytes_read < 0 )
+	fd = open( stats_file, O_RDWR|O_CREAT|O_TRUNC, 0644 );
+	if ( fd < 0 )
 	    {
-	    perror( "read" );
-	    close_connection();
-	    return 0;
+	    perror( stats_file );
+	    exit( 1 );
 	    }
-	if ( ! got_response )
+	if ( ftruncate( fd, sizeof(stats_shm) ) < 0 )
 	    {
-	    got_response = 1;
-	    (void) gettimeofday( &response_at, (struct timezone*) 0 );
+	    perror( stats_file );
+	    exit( 1 );
 	    }
-	if ( bytes_read == 0 )
+	shm = (stats_shm*) mmap(
+	    (void*) 0, sizeof(stats_shm), PROT_READ|PROT_WRITE, MAP_SHARED,
+	    fd, 0 );
+	if ( shm == (stats_shm*) MAP_FAILED )
 	    {
-	    close_connection();
-	    (void) gettimeofday( &finished_at, (struct timezone*) 0 );
-	    return 1;
+	    perror( "mmap" );
+	    exit( 1 );
 	    }
+	(void) close( fd );
+	st = &shm->s;
+	}
 
-	for ( bytes_handled = 0; bytes_handled < bytes_read; ++bytes_handled )
-	    {
-	    switch ( conn_state )
-		{
-		case ST_BOL:
-		switch ( buf[bytes_handled] )
-		    {
-		    case '\n':
-		    conn_state = ST_LF;
-		    break;
-		    case '\r':
-		    conn_state = ST_CR;
-		    break;
-		    case 'C': case 'c':
-		    conn_state = ST_C;
-		    break;
-		    default:
-		    conn_state = ST_TEXT;
-		    break;
-		    }
-		break;
+    /* Fill in everything else before the magic, so a reader never sees
+    ** a valid header on a half-initialized region.
+    */
+    shm->seq = 1;
+    shm->version = STATS_VERSION;
+    shm->pid = (long) getpid();
+    shm->created = (long long) time( (time_t*) 0 );
+    shm->mode = probe_mode;
+    report_mode = probe_mode;
+    (void) snprintf( shm->url, sizeof(shm->url), "%s", url );
+    clear_stats( st );
+    mem_barrier();
+    (void) strcpy( shm->magic, STATS_MAGIC );
+    mem_barrier();
+    shm->seq = 2;
+    }
 
-		case ST_TEXT:
-		switch ( buf[bytes_handled] )
-		    {
-		    case '\n':
-		    conn_state = ST_LF;
-		    break;
-		    case '\r':
-		    conn_state = ST_CR;
-		    break;
-		    default:
-		    break;
-		    }
-		break;
 
-		case ST_LF:
-		switch ( buf[bytes_handled] )
-		    {
-		    case '\n':
-		    conn_state = ST_DATA;
-		    break;
-		    case '\r':
-		    conn_state = ST_CR;
-		    break;
-		    case 'C': case 'c':
-		    conn_state = ST_C;
-		    break;
-		    default:
-		    conn_state = ST_TEXT;
-		    break;
-		    }
-		break;
+static void
+stats_begin( void )
+    {
+    sigset_t alrm;
 
-		case ST_CR:
-		switch ( buf[bytes_handled] )
-		    {
-		    case '\n':
-		    conn_state = ST_CRLF;
-		    break;
-		    case '\r':
-		    conn_state = ST_DATA;
-		    break;
-		    case 'C': case 'c':
-		    conn_state = ST_C;
-		    break;
-		    default:
-		    conn_state = ST_TEXT;
-		    break;
-		    }
-		break;
+    /* Brackets can nest; only the outermost one counts. */
+    if ( stats_depth++ > 0 )
+	return;
+    /* A timeout longjmps out of its handler, which would leave the
+    ** sequence odd for good if it landed in here.
+    */
+    (void) sigemptyset( &alrm );
+    (void) sigaddset( &alrm, SIGALRM );
+    (void) sigprocmask( SIG_BLOCK, &alrm, &stats_mask );
+    ++shm->seq;
+    mem_barrier();
+    }
 
-		case ST_CRLF:
-		switch ( buf[bytes_handled] )
-		    {
-		    case '\n':
-		    conn_state = ST_DATA;
-		    break;
-		    case '\r':
-		    conn_state = ST_CRLFCR;
-		    break;
-		    case 'C': case 'c':
-		    conn_state = ST_C;
-		    break;
-		    default:
-		    conn_state = ST_TEXT;
-		    break;
-		    }
-		break;
 
-		case ST_CRLFCR:
-		switch ( buf[bytes_handled] )
-		    {
-		    case '\n': case '\r':
-		    conn_state = ST_DATA;
-		    break;
-		    case 'C': case 'c':
-		    conn_state = ST_C;
-		    break;
-		    default:
-		    conn_state = ST_TEXT;
-		    break;
-		    }
-		break;
+static void
+stats_end( void )
+    {
+    if ( --stats_depth > 0 )
+	return;
+    mem_barrier();
+    ++shm->seq;
+    (void) sigprocmask( SIG_SETMASK, &stats_mask, (sigset_t*) 0 );
+    }
 
-		case ST_C:
-		switch ( buf[bytes_handled] )
-		    {
-		    case 'O': case 'o':
-		    conn_state = ST_CO;
-		    break;
-		    case '\n':
-		    conn_state = ST_LF;
-		    break;
+
+static void
+clear_stats( probe_stats* s )
+    {
+    int ph;
+
+    (void) memset( (void*) s, 0, sizeof(*s) );
+    for ( ph = 0; ph < NUM_PHASES; ++ph )
+	{
+	s->min[ph] = 1000000000.0;
+	s->max[ph] = -1000000000.0;
+	}
+    }
+
+
+/* Adds one completed probe to s.  The elapsed times are in usecs. */
+static void
+record_probe( probe_stats* s, long long* elapsed, long b )
+    {
+    int ph;
+    double ms;
+
+    ++s->completed;
+    s->bytes += b;
+    for ( ph = 0; ph < NUM_PHASES; ++ph )
+	{
+	ms = elapsed[ph] / 1000.0;
+	s->min[ph] = min( s->min[ph], ms );
+	s->max[ph] = max( s->max[ph], ms );
+	s->sum[ph] += ms;
+	hist_record( &s->hist[ph], elapsed[ph] );
+	}
+    }
+
+
+static void
+accum_add( accum* a, double v )
+    {
+    if ( a->n == 0 )
+	a->min = a->max = v;
+    else
+	{
+	a->min = min( a->min, v );
+	a->max = max( a->max, v );
+	}
+    a->sum += v;
+    ++a->n;
+    }
+
+
+static void
+report_accum( accum* a, char* name, char* unit )
+    {
+    if ( a->n > 0 )
+	(void) printf(
+	    "%-12s min/avg/max = %g/%g/%g%s\n", name,
+	    a->min, a->sum / a->n, a->max, unit );
+    }
+
+
+static void
+report_stats( probe_stats* s, int percentiles )
+    {
+    int started = max( s->started, 1 );
+    int ph;
+
+    (void) printf(
+	"%d requests started, %d completed (%d%%), %d failures (%d%%), %d timeouts (%d%%)\n",
+	s->started, s->completed, s->completed * 100 / started,
+	s->failures, s->failures * 100 / started,
+	s->timeouts, s->timeouts * 100 / started );
+    if ( s->invalid > 0 )
+	(void) printf(
+	    "%d responses failed validation (%d%%)\n", s->invalid,
+	    s->invalid * 100 / started );
+    if ( s->timeouts > 0 )
+	{
+	(void) printf( "timeouts by phase:" );
+	for ( ph = 0; ph < NUM_TO; ++ph )
+	    if ( s->phase_timeouts[ph] > 0 )
+		(void) printf( " %d %s", s->phase_timeouts[ph], to_names[ph] );
+	(void) printf( "\n" );
+	}
+    if ( s->port_failures > 0 )
+	(void) printf(
+	    "%d local port allocation failures\n", s->port_failures );
+    for ( ph = 0; ph < NUM_ENC && s->enc_count[ph] == 0; ++ph )
+	;
+    if ( ph < NUM_ENC )
+	{
+	(void) printf( "content encodings:" );
+	for ( ph = 0; ph < NUM_ENC; ++ph )
+	    if ( s->enc_count[ph] > 0 )
+		(void) printf( " %d %s", s->enc_count[ph], enc_names[ph] );
+	if ( s->dec_wire > 0 )
+	    (void) printf(
+		", %lld bytes on the wire decoded to %lld (%gx)", s->dec_wire,
+		s->dec_bytes, (double) s->dec_bytes / s->dec_wire );
+	(void) printf( "\n" );
+	}
+    report_phases( s, percentiles );
+    }
+
+
+/* Reports a subset of the probes, such as the ones that used TFO. */
+static void
+report_group( probe_stats* s, char* label )
+    {
+    (void) printf(
+	"--- %s: %d completed, %lld bytes\n", label, s->completed, s->bytes );
+    report_phases( s, 1 );
+    }
+
+
+/* Whether the probe mode has phase ph at all; -mode tcp and tls stop
+** once connected, so they have only the total and connect times.
+*/
+static int
+phase_measured( int ph )
+    {
+    return report_mode == MODE_HTTP || ph == PH_TOTAL || ph == PH_CONNECT;
+    }
+
+
+static void
+report_phases( probe_stats* s, int percentiles )
+    {
+    int ph, ti;
+
+    if ( s->completed <= 0 )
+	return;
+    for ( ph = 0; ph < NUM_PHASES; ++ph )
+	if ( phase_measured( ph ) )
+	    (void) printf(
+		"%s min/avg/max = %g/%g/%g ms\n", phase_names[ph],
+		s->min[ph], s->sum[ph] / s->completed, s->max[ph] );
+    for ( ti = 0; ti < NUM_TI; ++ti )
+	report_accum( &s->ti[ti], ti_names[ti], ti_units[ti] );
+    report_accum( &s->wire, "wire", " ms" );
+    report_accum( &s->app_noise, "client noise", " ms" );
+    report_accum( &s->tp_mean, "throughput", " MB/s" );
+    if ( hist_percentile( &s->tp_hist, 50.0 ) > 0 )
+	(void) printf(
+	    "%-12s p1/p10/p50/p90 = %g/%g/%g/%g MB/s per interval\n",
+	    "throughput",
+	    hist_percentile( &s->tp_hist, 1.0 ) / 1000.0,
+	    hist_percentile( &s->tp_hist, 10.0 ) / 1000.0,
+	    hist_percentile( &s->tp_hist, 50.0 ) / 1000.0,
+	    hist_percentile( &s->tp_hist, 90.0 ) / 1000.0 );
+    report_accum( &s->tp_first_mb, "first MB", " ms" );
+    report_accum( &s->dec_ratio, "compression", "x" );
+    report_accum( &s->dec_ms, "decode", " ms" );
+    report_accum( &s->hops, "redirects", "" );
+    report_accum( &s->redirect_ms, "redirect", " ms" );
+    report_accum( &s->proxy_ms, "proxy", " ms" );
+    report_accum( &s->tunnel_ms, "tunnel", " ms" );
+    report_accum( &s->tls_ms, "origin tls", " ms" );
+    if ( s->tp_mean.n > 0 )
+	(void) printf(
+	    "%d stalled intervals, %g ms without data\n", s->tp_stalls,
+	    s->tp_stall_ms );
+    if ( ! percentiles )
+	return;
+    for ( ph = 0; ph < NUM_PHASES; ++ph )
+	if ( phase_measured( ph ) )
+	    (void) printf(
+		"%s p50/p90/p99/p99.9 = %g/%g/%g/%g ms\n", phase_names[ph],
+		hist_percentile( &s->hist[ph], 50.0 ) / 1000.0,
+		hist_percentile( &s->hist[ph], 90.0 ) / 1000.0,
+		hist_percentile( &s->hist[ph], 99.0 ) / 1000.0,
+		hist_percentile( &s->hist[ph], 99.9 ) / 1000.0 );
+    }
+
+
+/* Reader side of -stats-file.  Takes a consistent snapshot without ever
+** writing to the region, so it can't slow the prober down.
+*/
+static void
+read_stats( char* filename )
+    {
+    int fd, tries;
+    stats_shm* rshm;
+    stats_shm snap;
+    unsigned int seq1, seq2;
+    struct stat sb;
+
+    fd = open( filename, O_RDONLY );
+    if ( fd < 0 )
+	{
+	perror( filename );
+	exit( 1 );
+	}
+    /* Mapping past the end of a short file would be a SIGBUS. */
+    if ( fstat( fd, &sb ) < 0 )
+	{
+	perror( filename );
+	exit( 1 );
+	}
+    if ( sb.st_size < sizeof(stats_shm) )
+	{
+	(void) fprintf(
+	    stderr, "%s: %s - not an http_ping stats file\n", argv0, filename );
+	exit( 1 );
+	}
+    rshm = (stats_shm*) mmap(
+	(void*) 0, sizeof(stats_shm), PROT_READ, MAP_SHARED, fd, 0 );
+    if ( rshm == (stats_shm*) MAP_FAILED )
+	{
+	perror( "mmap" );
+	exit( 1 );
+	}
+    (void) close( fd );
+
+    for ( tries = 0; ; ++tries )
+	{
+	if ( tries >= 1000000 )
+	    {
+	    (void) fprintf(
+		stderr, "%s: %s - no consistent snapshot\n", argv0, filename );
+	    exit( 1 );
+	    }
+	seq1 = rshm->seq;
+	if ( seq1 & 1 )
+	    continue;
+	mem_barrier();
+	(void) memcpy( (void*) &snap, (void*) rshm, sizeof(snap) );
+	mem_barrier();
+	seq2 = rshm->seq;
+	if ( seq1 == seq2 )
+	    break;
+	}
+    (void) munmap( (void*) rshm, sizeof(stats_shm) );
+
+    if ( strncmp( snap.magic, STATS_MAGIC, sizeof(snap.magic) ) != 0 ||
+	 snap.version != STATS_VERSION )
+	{
+	(void) fprintf(
+	    stderr, "%s: %s - not an http_ping stats file\n", argv0, filename );
+	exit( 1 );
+	}
+    snap.url[sizeof(snap.url) - 1] = '\0';
+    report_mode = snap.mode;
+    (void) printf(
+	"--- %s http_ping statistics (pid %ld, up %lld s) ---\n", snap.url,
+	snap.pid, (long long) time( (time_t*) 0 ) - snap.created );
+    report_stats( &snap.s, 1 );
+    }
+
+
+/* The int counters of a -hist-file, in file order. */
+static void
+hist_file_counts( probe_stats* s, int** counts )
+    {
+    int n, i;
+
+    n = 0;
+    counts[n++] = &s->started;
+    counts[n++] = &s->completed;
+    counts[n++] = &s->failures;
+    counts[n++] = &s->timeouts;
+    counts[n++] = &s->invalid;
+    counts[n++] = &s->port_failures;
+    for ( i = 0; i < NUM_TO; ++i )
+	counts[n++] = &s->phase_timeouts[i];
+    counts[n++] = &s->tp_stalls;
+    for ( i = 0; i < NUM_ENC; ++i )
+	counts[n++] = &s->enc_count[i];
+    }
+
+
+/* The accumulators of a -hist-file, in file order. */
+static void
+hist_file_accums( probe_stats* s, accum** accums )
+    {
+    int n, i;
+
+    n = 0;
+    for ( i = 0; i < NUM_TI; ++i )
+	accums[n++] = &s->ti[i];
+    accums[n++] = &s->wire;
+    accums[n++] = &s->app_noise;
+    accums[n++] = &s->tp_mean;
+    accums[n++] = &s->tp_first_mb;
+    accums[n++] = &s->dec_ratio;
+    accums[n++] = &s->dec_ms;
+    accums[n++] = &s->hops;
+    accums[n++] = &s->redirect_ms;
+    accums[n++] = &s->proxy_ms;
+    accums[n++] = &s->tunnel_ms;
+    accums[n++] = &s->tls_ms;
+    }
+
+
+static void
+put_varint( FILE* fp, unsigned long long v )
+    {
+    while ( v >= 0x80 )
+	{
+	(void) putc( (int) ( ( v & 0x7f ) | 0x80 ), fp );
+	v >>= 7;
+	}
+    (void) putc( (int) v, fp );
+    }
+
+
+static void
+put_double( FILE* fp, double d )
+    {
+    unsigned long long bits;
+    int i;
+
+    (void) memcpy( (void*) &bits, (void*) &d, sizeof(bits) );
+    for ( i = 0; i < 8; ++i )
+	(void) putc( (int) ( ( bits >> ( i * 8 ) ) & 0xff ), fp );
+    }
+
+
+static void
+put_hist( FILE* fp, histogram* h )
+    {
+    int i, n, last;
+
+    for ( i = n = 0; i < HIST_BUCKETS; ++i )
+	if ( h->counts[i] != 0 )
+	    ++n;
+    put_varint( fp, n );
+    for ( i = 0, last = -1; i < HIST_BUCKETS; ++i )
+	if ( h->counts[i] != 0 )
+	    {
+	    put_varint( fp, i - last - 1 );
+	    put_varint( fp, h->counts[i] );
+	    last = i;
+	    }
+    }
+
+
+static void
+write_hist_file( char* filename, probe_stats* s )
+    {
+    FILE* fp;
+    int* counts[HIST_FILE_COUNTS];
+    accum* accums[HIST_FILE_ACCUMS];
+    int i, ph;
+
+    fp = fopen( filename, "wb" );
+    if ( fp == (FILE*) 0 )
+	{
+	perror( filename );
+	return;
+	}
+    (void) fwrite( HIST_FILE_MAGIC, 1, strlen( HIST_FILE_MAGIC ), fp );
+    (void) putc( HIST_FILE_VERSION, fp );
+    /* The bucket layout, so a differently built binary won't mix them. */
+    put_varint( fp, HIST_SUB_BITS );
+    put_varint( fp, HIST_MAX_BITS );
+    put_varint( fp, NUM_PHASES );
+    put_varint( fp, HIST_FILE_COUNTS );
+    put_varint( fp, HIST_FILE_ACCUMS );
+    put_varint( fp, probe_mode );
+    hist_file_counts( s, counts );
+    for ( i = 0; i < HIST_FILE_COUNTS; ++i )
+	put_varint( fp, *counts[i] );
+    put_varint( fp, s->bytes );
+    put_varint( fp, s->dec_wire );
+    put_varint( fp, s->dec_bytes );
+    put_double( fp, s->tp_stall_ms );
+    hist_file_accums( s, accums );
+    for ( i = 0; i < HIST_FILE_ACCUMS; ++i )
+	{
+	put_varint( fp, accums[i]->n );
+	put_double( fp, accums[i]->min );
+	put_double( fp, accums[i]->max );
+	put_double( fp, accums[i]->sum );
+	}
+    for ( ph = 0; ph < NUM_PHASES; ++ph )
+	{
+	put_double( fp, s->min[ph] );
+	put_double( fp, s->max[ph] );
+	put_double( fp, s->sum[ph] );
+	put_hist( fp, &s->hist[ph] );
+	}
+    put_hist( fp, &s->tp_hist );
+    if ( fclose( fp ) == EOF )
+	perror( filename );
+    }
+
+
+/* The get_ routines take from *cpP, and return 0 if they'd run past end. */
+static int
+get_varint( unsigned char** cpP, unsigned char* end, unsigned long long* vP )
+    {
+    int shift;
+
+    *vP = 0;
+    for ( shift = 0; *cpP < end && shift < 64; shift += 7 )
+	{
+	*vP |= (unsigned long long) ( **cpP & 0x7f ) << shift;
+	if ( ( *(*cpP)++ & 0x80 ) == 0 )
+	    return 1;
+	}
+    return 0;
+    }
+
+
+static int
+get_double( unsigned char** cpP, unsigned char* end, double* dP )
+    {
+    unsigned long long bits;
+    int i;
+
+    if ( end - *cpP < 8 )
+	return 0;
+    bits = 0;
+    for ( i = 0; i < 8; ++i )
+	bits |= (unsigned long long) *(*cpP)++ << ( i * 8 );
+    (void) memcpy( (void*) dP, (void*) &bits, sizeof(bits) );
+    return 1;
+    }
+
+
+/* Adds a histogram from the file into h. */
+static int
+get_hist( unsigned char** cpP, unsigned char* end, histogram* h )
+    {
+    unsigned long long n, gap, count;
+    int i;
+
+    if ( ! get_varint( cpP, end, &n ) )
+	return 0;
+    for ( i = -1; n > 0; --n )
+	{
+	if ( ! get_varint( cpP, end, &gap ) || ! get_varint( cpP, end, &count ) )
+	    return 0;
+	i += gap + 1;
+	if ( i >= HIST_BUCKETS )
+	    return 0;
+	h->counts[i] += count;
+	}
+    return 1;
+    }
+
+
+/* Adds one -hist-file into s; returns 0 if it isn't one.  The first
+** file's -mode goes in *modeP, and later ones must match it.
+*/
+static int
+merge_hist_file( char* filename, probe_stats* s, int* modeP )
+    {
+    static unsigned char buf[HIST_FILE_MAX];
+    FILE* fp;
+    unsigned char* cp;
+    unsigned char* end;
+    int* counts[HIST_FILE_COUNTS];
+    accum* accums[HIST_FILE_ACCUMS];
+    accum a;
+    unsigned long long v;
+    double d;
+    int len, i, ph;
+
+    fp = fopen( filename, "rb" );
+    if ( fp == (FILE*) 0 )
+	{
+	perror( filename );
+	exit( 1 );
+	}
+    len = fread( (void*) buf, 1, sizeof(buf), fp );
+    (void) fclose( fp );
+    cp = buf;
+    end = buf + len;
+    i = strlen( HIST_FILE_MAGIC );
+    if ( len <= i || memcmp( buf, HIST_FILE_MAGIC, i ) != 0 ||
+	 buf[i] != HIST_FILE_VERSION )
+	return 0;
+    cp += i + 1;
+    if ( ! get_varint( &cp, end, &v ) || v != HIST_SUB_BITS ||
+	 ! get_varint( &cp, end, &v ) || v != HIST_MAX_BITS ||
+	 ! get_varint( &cp, end, &v ) || v != NUM_PHASES ||
+	 ! get_varint( &cp, end, &v ) || v != HIST_FILE_COUNTS ||
+	 ! get_varint( &cp, end, &v ) || v != HIST_FILE_ACCUMS )
+	return 0;
+    if ( ! get_varint( &cp, end, &v ) )
+	return 0;
+    if ( *modeP < 0 )
+	*modeP = (int) v;
+    else if ( v != *modeP )
+	{
+	(void) fprintf(
+	    stderr, "%s: %s - taken with a different -mode\n", argv0,
+	    filename );
+	exit( 1 );
+	}
+    hist_file_counts( s, counts );
+    for ( i = 0; i < HIST_FILE_COUNTS; ++i )
+	{
+	if ( ! get_varint( &cp, end, &v ) )
+	    return 0;
+	*counts[i] += v;
+	}
+    if ( ! get_varint( &cp, end, &v ) )
+	return 0;
+    s->bytes += v;
+    if ( ! get_varint( &cp, end, &v ) )
+	return 0;
+    s->dec_wire += v;
+    if ( ! get_varint( &cp, end, &v ) )
+	return 0;
+    s->dec_bytes += v;
+    if ( ! get_double( &cp, end, &d ) )
+	return 0;
+    s->tp_stall_ms += d;
+    hist_file_accums( s, accums );
+    for ( i = 0; i < HIST_FILE_ACCUMS; ++i )
+	{
+	if ( ! get_varint( &cp, end, &v ) ||
+	     ! get_double( &cp, end, &a.min ) ||
+	     ! get_double( &cp, end, &a.max ) ||
+	     ! get_double( &cp, end, &a.sum ) )
+	    return 0;
+	if ( v == 0 )
+	    continue;
+	if ( accums[i]->n == 0 )
+	    {
+	    accums[i]->min = a.min;
+	    accums[i]->max = a.max;
+	    }
+	else
+	    {
+	    accums[i]->min = min( accums[i]->min, a.min );
+	    accums[i]->max = max( accums[i]->max, a.max );
+	    }
+	accums[i]->n += v;
+	accums[i]->sum += a.sum;
+	}
+    for ( ph = 0; ph < NUM_PHASES; ++ph )
+	{
+	if ( ! get_double( &cp, end, &d ) )
+	    return 0;
+	s->min[ph] = min( s->min[ph], d );
+	if ( ! get_double( &cp, end, &d ) )
+	    return 0;
+	s->max[ph] = max( s->max[ph], d );
+	if ( ! get_double( &cp, end, &d ) )
+	    return 0;
+	s->sum[ph] += d;
+	if ( ! get_hist( &cp, end, &s->hist[ph] ) )
+	    return 0;
+	}
+    return get_hist( &cp, end, &s->tp_hist ) && cp == end;
+    }
+
+
+/* -merge: adds up the -hist-file of each run and reports them as one. */
+static void
+merge_hist_files( int nfiles, char** filenames )
+    {
+    static probe_stats merged;
+    int i, mode;
+
+    clear_stats( &merged );
+    mode = -1;
+    for ( i = 0; i < nfiles; ++i )
+	if ( ! merge_hist_file( filenames[i], &merged, &mode ) )
+	    {
+	    (void) fprintf(
+		stderr, "%s: %s - not an http_ping histogram file\n", argv0,
+		filenames[i] );
+	    exit( 1 );
+	    }
+    report_mode = mode;
+    (void) printf( "--- %d merged http_ping runs ---\n", nfiles );
+    report_stats( &merged, 1 );
+    }
+
+
+static int
+hist_index( long long usecs )
+    {
+    int msb, shift;
+
+    if ( usecs < HIST_SUB )
+	return usecs < 0 ? 0 : (int) usecs;
+    for ( msb = HIST_SUB_BITS; msb < 62 && ( usecs >> ( msb + 1 ) ) != 0; ++msb )
+	;
+    if ( msb >= HIST_MAX_BITS )
+	return HIST_BUCKETS - 1;
+    shift = msb - HIST_SUB_BITS;
+    return ( shift + 1 ) * HIST_SUB + (int) ( usecs >> shift ) - HIST_SUB;
+    }
+
+
+/* Returns the midpoint of bucket i, in usecs. */
+static long long
+hist_value( int i )
+    {
+    int shift;
+
+    if ( i < HIST_SUB )
+	return i;
+    shift = i / HIST_SUB - 1;
+    return ( (long long) ( i % HIST_SUB + HIST_SUB ) << shift ) +
+	( ( 1LL << shift ) >> 1 );
+    }
+
+
+static void
+hist_record( histogram* h, long long usecs )
+    {
+    ++h->counts[hist_index( usecs )];
+    }
+
+
+static long long
+hist_percentile( histogram* h, double pct )
+    {
+    int i;
+    unsigned long long total, want, seen;
+
+    total = 0;
+    for ( i = 0; i < HIST_BUCKETS; ++i )
+	total += h->counts[i];
+    if ( total == 0 )
+	return 0;
+    want = (unsigned long long) ( total * pct / 100.0 + 0.999999 );
+    if ( want < 1 )
+	want = 1;
+    seen = 0;
+    for ( i = 0; i < HIST_BUCKETS; ++i )
+	{
+	seen += h->counts[i];
+	if ( seen >= want )
+	    return hist_value( i );
+	}
+    return hist_value( HIST_BUCKETS - 1 );
+    }
+
+static void
+parse_request_file( void )
+	{
+		/* TODO */
+	}
+
+static void
+parse_url( void )
+    {
+    char* http = "http://";
+    int http_len = strlen( http );
+    char* http_unix = "http+unix://";
+    int http_unix_len = strlen( http_unix );
+#ifdef USE_SSL
+    char* https = "https://";
+    int https_len = strlen( https );
+    char* https_unix = "https+unix://";
+    int https_unix_len = strlen( https_unix );
+#endif
+    int proto_len, host_len;
+    char* cp;
+
+    url_unix = 0;
+    if ( strncmp( http, url, http_len ) == 0 )
+	{
+	proto_len = http_len;
+	url_protocol = PROTO_HTTP;
+	}
+    else if ( strncmp( http_unix, url, http_unix_len ) == 0 )
+	{
+	proto_len = http_unix_len;
+	url_protocol = PROTO_HTTP;
+	url_unix = 1;
+	}
+#ifdef USE_SSL
+    else if ( strncmp( https, url, https_len ) == 0 )
+	{
+	proto_len = https_len;
+	url_protocol = PROTO_HTTPS;
+	}
+    else if ( strncmp( https_unix, url, https_unix_len ) == 0 )
+	{
+	proto_len = https_unix_len;
+	url_protocol = PROTO_HTTPS;
+	url_unix = 1;
+	}
+#endif
+    else
+	{
+	(void) fprintf( stderr, "%s: unknown protocol - %s\n", argv0, url );
+	exit( 1 );
+	}
+
+    /* For the unix forms the "host" is the percent-encoded socket path,
+    ** e.g. http+unix://%2Fvar%2Frun%2Fapp.sock/status
+    */
+    if ( url_unix )
+	{
+	for ( cp = url + proto_len; *cp != '\0' && *cp != '/'; ++cp )
+	    ;
+	url_decode(
+	    url_unix_path, sizeof(url_unix_path), url + proto_len,
+	    cp - url - proto_len );
+	if ( url_unix_path[0] == '\0' )
+	    {
+	    (void) fprintf( stderr, "%s: no socket path - %s\n", argv0, url );
+	    exit( 1 );
+	    }
+	(void) strcpy( url_host, "localhost" );
+	url_port = 0;
+	if ( *cp == '\0' )
+	    url_filename = "/";
+	else
+	    url_filename = cp;
+	return;
+	}
+    for ( cp = url + proto_len;
+	 *cp != '\0' && *cp != ':' && *cp != '/'; ++cp )
+	;
+    host_len = cp - url;
+    host_len -= proto_len;
+    host_len = min( host_len, sizeof(url_host) - 1 );
+    strncpy( url_host, url + proto_len, host_len );
+    url_host[host_len] = '\0';
+    if ( *cp == ':' )
+	{
+	url_port = (unsigned short) atoi( ++cp );
+	while ( *cp != '\0' && *cp != '/' )
+	    ++cp;
+	}
+    else
+#ifdef USE_SSL
+	if ( url_protocol == PROTO_HTTPS )
+	    url_port = 443;
+	else
+	    url_port = 80;
+#else
+	url_port = 80;
+#endif
+    if ( *cp == '\0' )
+	url_filename = "/";
+    else
+	url_filename = cp;
+    }
+
+
+/* Decodes %xx escapes from fromlen chars of from. */
+static void
+url_decode( char* to, int tosize, char* from, int fromlen )
+    {
+    int i, n;
+    char hex[3];
+
+    for ( i = n = 0; i < fromlen && n < tosize - 1; ++i )
+	{
+	if ( from[i] == '%' && i + 2 < fromlen &&
+	     isxdigit( (unsigned char) from[i + 1] ) &&
+	     isxdigit( (unsigned char) from[i + 2] ) )
+	    {
+	    hex[0] = from[i + 1];
+	    hex[1] = from[i + 2];
+	    hex[2] = '\0';
+	    to[n++] = (char) strtol( hex, (char**) 0, 16 );
+	    i += 2;
+	    }
+	else
+	    to[n++] = from[i];
+	}
+    to[n] = '\0';
+    }
+
+
+static void
+init_net( void )
+    {
+    char* host;
+
+    if ( url_unix )
+	{
+	if ( do_proxy || bind_list != (char*) 0 || do_tfo || do_tcpinfo )
+	    {
+	    (void) fprintf(
+		stderr,
+		"%s: -proxy, -bind, -tfo and -tcpinfo don't apply to unix sockets\n",
+		argv0 );
+	    exit( 1 );
+	    }
+	lookup_unix_path();
+	return;
+	}
+    if ( do_proxy )
+	{
+	host = proxy_host;
+	port = proxy_port;
+	}
+    else
+	{
+	host = url_host;
+	port = url_port;
+	}
+    lookup_address( host, port );
+    if ( bind_list != (char*) 0 )
+	lookup_bind_addresses();
+    }
+
+
+/* One probe: the fetch, or just the connect in the connect-only modes,
+** then with -follow the rest of the redirect chain.
+*/
+static int
+fetch_probe( void )
+    {
+    struct timeval chain_at, hop_at;
+    int ok, r;
+
+    if ( hop_moved )
+	follow_restore();
+    num_hops = hop_overflow = num_reused = 0;
+    redirect_usecs = 0;
+    conn_reused = 0;
+    if ( proxy_keep && conn_fd >= 0 && keep_matches() && conn_alive() )
+	{
+	ok = reuse_connection() && handle_read();
+	/* The proxy dropped it after all; start over. */
+	if ( resp_status == 0 )
+	    {
+	    close_connection();
+	    ok = start_connection() && handle_read();
+	    }
+	else
+	    conn_reused = 1;
+	}
+    else
+	{
+	close_connection();
+	ok = start_connection() && ( probe_mode != MODE_HTTP || handle_read() );
+	}
+    if ( follow_max == 0 || probe_mode != MODE_HTTP )
+	{
+	if ( ! ok )
+	    close_connection();
+	return ok;
+	}
+    chain_at = started_at;
+    while ( ok && is_redirect( resp_status ) && resp_location[0] != '\0' )
+	{
+	if ( num_hops == follow_max )
+	    {
+	    hop_overflow = 1;
+	    break;
+	    }
+	hop_at = started_at;
+	hop_status[num_hops] = resp_status;
+	timeout_phase( TO_CONNECT );
+	r = follow_location();
+	if ( r <= 0 )
+	    {
+	    ok = r == 0;
+	    break;
+	    }
+	if ( conn_fd >= 0 && conn_alive() )
+	    {
+	    ok = reuse_connection() && handle_read();
+	    /* It closed under us after all, so start over, as browsers do. */
+	    if ( resp_status == 0 )
+		{
+		close_connection();
+		ok = start_connection() && handle_read();
+		}
+	    else
+		++num_reused;
+	    }
+	else
+	    {
+	    close_connection();
+	    ok = start_connection() && handle_read();
+	    }
+	hop_usecs[num_hops++] = delta_timeval( &hop_at, &started_at );
+	}
+    /* A redirect we didn't follow may have left its connection open;
+    ** -proxy-keepalive wants it that way.
+    */
+    if ( ! ( ok && proxy_keep ) )
+	close_connection();
+    redirect_usecs = delta_timeval( &chain_at, &started_at );
+    if ( hop_moved )
+	follow_restore();
+    return ok;
+    }
+
+
+static int
+is_redirect( int status )
+    {
+    return status == 301 || status == 302 || status == 303 ||
+	status == 307 || status == 308;
+    }
+
+
+/* Clears the per-request state and starts the clock. */
+static void
+reset_response( void )
+    {
+    (void) gettimeofday( &started_at, (struct timezone*) 0 );
+    got_response = 0;
+    content_length = -1;
+    hdr_len = hdr_lines = 0;
+    resp_status = 0;
+    cache_class = cache_status_class = x_cache_class = CC_UNKNOWN;
+    resp_age = -1;
+    resp_etag[0] = resp_last_modified[0] = '\0';
+    resp_backend = (probe_stats*) 0;
+    resp_backend_name = "";
+    body_match = body_found = 0;
+    body_hash = 14695981039346656037ULL;
+    resp_encoding = ENC_IDENTITY;
+    resp_chunked = 0;
+    resp_location[0] = '\0';
+    chunk_state = CK_SIZE;
+    chunk_left = 0;
+    dec_started = dec_done = dec_failed = 0;
+    dec_bytes = dec_usecs = 0;
+#ifdef USE_BROTLI
+    if ( dec_br != (BrotliDecoderState*) 0 )
+	{
+	BrotliDecoderDestroyInstance( dec_br );
+	dec_br = (BrotliDecoderState*) 0;
+	}
+#endif
+    bytes = 0;
+    got_tcp_info = 0;
+    tfo_accepted = 0;
+    got_tx_ts = got_rx_ts = got_tx_hw = got_rx_hw = 0;
+    tp_reset();
+    slow_total = 0;
+    resp_close = 0;
+    }
+
+
+static int
+start_connection( void )
+    {
+#ifdef USE_SSL
+    int r;
+#endif
+
+    reset_response();
+    conn_fd = open_client_socket();
+    if ( conn_fd < 0 )
+	return 0;
+    (void) gettimeofday( &tcp_at, (struct timezone*) 0 );
+
+#ifdef USE_SSL
+    /* Through a proxy, https needs a tunnel to the origin first. */
+    tunnelled = do_proxy && url_protocol == PROTO_HTTPS && probe_mode != MODE_TCP;
+    if ( tunnelled )
+	{
+	if ( ! open_tunnel() )
+	    {
+	    close_connection();
+	    return 0;
+	    }
+	(void) gettimeofday( &tunnel_at, (struct timezone*) 0 );
+	}
+#endif
+    timeout_phase( TO_TLS );
+
+#ifdef USE_SSL
+    ssl = (SSL*) 0;
+    if ( url_protocol == PROTO_HTTPS && probe_mode != MODE_TCP )
+	{
+	/* Complete the SSL connection. */
+	if ( ssl_ctx == (SSL_CTX*) 0 )
+	    {
+	    SSL_load_error_strings();
+	    SSLeay_add_ssl_algorithms();
+	    ssl_ctx = SSL_CTX_new( SSLv23_client_method() );
+	    }
+	if ( ! RAND_status() )
+	    {
+	    unsigned char rb[1024];
+	    int i;
+	    for ( i = 0; i < sizeof(rb); ++i )
+		rb[i] = random() % 0xff;
+	    RAND_seed( rb, sizeof(rb) );
+	    }
+	ssl = SSL_new( ssl_ctx );
+	SSL_set_fd( ssl, conn_fd );
+	if ( tunnelled )
+	    (void) SSL_set_tlsext_host_name( ssl, url_host );
+	r = SSL_connect( ssl );
+	if ( r <= 0 )
+	    {
+	    (void) fprintf(
+		stderr, "%s: SSL connection failed - %d\n", argv0, r );
+	    ERR_print_errors_fp( stderr );
+	    close_connection();
+	    return 0;
+	    }
+	}
+#endif
+    (void) gettimeofday( &connect_at, (struct timezone*) 0 );
+    if ( do_tcpinfo )
+	capture_tcp_info( 1 );
+
+    /* The connect-only modes are done now. */
+    if ( probe_mode != MODE_HTTP )
+	{
+	response_at = finished_at = connect_at;
+	finish_probe();
+	close_connection();
+	return 1;
+	}
+    conn_keep = ( follow_max > 0 && ( ! do_proxy || tunnelled ) ) || proxy_keep;
+    if ( proxy_keep )
+	keep_origin_name( keep_origin, sizeof(keep_origin) );
+    return send_request();
+    }
+
+
+/* The origin a -proxy-keepalive connection serves.  Through a tunnel
+** that's fixed; otherwise any origin can go to the proxy.
+*/
+static void
+keep_origin_name( char* buf, int size )
+    {
+    if ( tunnelled )
+	(void) snprintf( buf, size, "%d %.500s:%d", url_protocol, url_host, (int) url_port );
+    else
+	(void) snprintf( buf, size, "%d", url_protocol );
+    }
+
+
+/* Whether the kept -proxy-keepalive connection can carry this probe. */
+static int
+keep_matches( void )
+    {
+    char here[sizeof(keep_origin)];
+
+    keep_origin_name( here, sizeof(here) );
+    return strcmp( here, keep_origin ) == 0;
+    }
+
+
+/* Whether a kept connection is still usable.  Anything readable before
+** we've asked for something is the server closing it.
+*/
+static int
+conn_alive( void )
+    {
+    struct pollfd pfd;
+
+    pfd.fd = conn_fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    return poll( &pfd, 1, 0 ) == 0;
+    }
+
+
+/* A -follow hop, or with -proxy-keepalive a new probe, on the connection
+** the last response came in on; there's no connect or handshake time.
+*/
+static int
+reuse_connection( void )
+    {
+    reset_response();
+    tcp_at = tunnel_at = connect_at = started_at;
+    return send_request();
+    }
+
+
+static int
+send_request( void )
+    {
+    char buf[5000];
+    char path_buf[2000];
+    char* path;
+    int b, h, r;
+
+    /* Format the request.  Paths are limited to what path_buf holds,
+    ** rather than being quietly cut short into some other URL.
+    */
+    path = url_filename;
+    if ( url_templated )
+	{
+	(void) tm_expand( &url_tm, path_buf, sizeof(path_buf) );
+	path = path_buf;
+	}
+    if ( strlen( path ) >= sizeof(path_buf) - 1 )
+	{
+	(void) fprintf(
+	    stderr, "%s: request path longer than %d characters\n", argv0,
+	    (int) sizeof(path_buf) - 2 );
+	close_connection();
+	return 0;
+	}
+    if ( do_proxy && ! tunnelled )
+	{
+#ifdef USE_SSL
+	b = snprintf(
+	    buf, sizeof(buf), "GET %s://%.500s:%d%s HTTP/1.%d\r\n",
+	    url_protocol == PROTO_HTTPS ? "https" : "http", url_host,
+	    (int) url_port, path, conn_keep );
+#else
+	b = snprintf(
+	    buf, sizeof(buf), "GET http://%.500s:%d%s HTTP/1.%d\r\n",
+	    url_host, (int) url_port, path, conn_keep );
+#endif
+	}
+    else
+	b = snprintf(
+	    buf, sizeof(buf), "%.100s %s HTTP/1.1\r\n", method ? method : "GET",
+	    path );
+    b += snprintf( &buf[b], sizeof(buf) - b, "Host: %.500s\r\n", vhost ? vhost : url_host );
+    b += snprintf( &buf[b], sizeof(buf) - b, "User-Agent: http_ping\r\n" );
+    /* Leave room for the last few lines, which are bounded so that b
+    ** can't run past the end of buf.
+    */
+    for ( h = 0; h < num_headers && b < sizeof(buf) - 700; ++h )
+	{
+	b += tm_expand( &headers[h], &buf[b], sizeof(buf) - 700 - b );
+	b += snprintf( &buf[b], sizeof(buf) - b, "\r\n" );
+	}
+    if ( do_conditional && cond_etag[0] != '\0' )
+	b += snprintf( &buf[b], sizeof(buf) - b, "If-None-Match: %s\r\n", cond_etag );
+    if ( do_conditional && cond_last_modified[0] != '\0' )
+	b += snprintf( &buf[b], sizeof(buf) - b, "If-Modified-Since: %s\r\n", cond_last_modified );
+    if ( accept_encoding != (char*) 0 )
+	b += snprintf( &buf[b], sizeof(buf) - b, "Accept-Encoding: %.200s\r\n", accept_encoding );
+    if ( req_body_len > 0 )
+	b += snprintf( &buf[b], sizeof(buf) - b, "Content-Length: %ld\r\n", req_body_len );
+    b += snprintf(
+	&buf[b], sizeof(buf) - b, "Connection: %s\r\n\r\n",
+	conn_keep ? "keep-alive" : "Close" );
+
+    /* Send the request. */
+    (void) gettimeofday( &sent_at, (struct timezone*) 0 );
+    timeout_phase( TO_TTFB );
+    r = conn_write( buf, b );
+
+    /* Then the body, if a -replay line gave one; the contents don't matter. */
+    if ( r >= 0 && req_body_len > 0 )
+	{
+	static char filler[4096];
+	long left;
+
+	(void) memset( (void*) filler, 'x', sizeof(filler) );
+	for ( left = req_body_len; left > 0 && r >= 0; left -= r )
+	    r = conn_write( filler, (int) min( left, (long) sizeof(filler) ) );
+	}
+    if ( r < 0 )
+	{
+	perror( "write" );
+	close_connection();
+	return 0;
+	}
+
+    /* With -lowjitter the reads spin instead of sleeping in the kernel. */
+    if ( do_lowjitter )
+	(void) fcntl( conn_fd, F_SETFL, fcntl( conn_fd, F_GETFL, 0 ) | O_NONBLOCK );
+    conn_state = ST_BOL;
+    return 1;
+    }
+
+
+#if defined(AF_INET6) && defined(IN6_IS_ADDR_V4MAPPED)
+#define USE_IPV6
+#endif
+
+#ifdef USE_IPV6
+static struct sockaddr_in6 sa;
+#else /* USE_IPV6 */
+static struct sockaddr_in sa;
+#endif /* USE_IPV6 */
+static struct sockaddr_un sun_sa;
+static int sa_len, sock_family, sock_type, sock_protocol;
+
+/* Everything that says where a probe goes, so -follow and -ab can switch
+** between URLs without parsing and looking them up again.
+*/
+typedef struct {
+    char* url;
+    int protocol;
+    char host[sizeof(url_host)];
+    unsigned short port;
+    int is_unix;
+    char* filename;
+    char* method;
+    char* vhost;
+    long body_len;
+    template tm;
+    int templated;
+#ifdef USE_IPV6
+    struct sockaddr_in6 sa;
+#else /* USE_IPV6 */
+    struct sockaddr_in sa;
+#endif /* USE_IPV6 */
+    struct sockaddr_un sun_sa;
+    int sa_len, sock_family, sock_type, sock_protocol;
+    } target;
+static target home;
+static target ab_targets[2];
+
+/* Local source addresses for -bind, used round-robin. */
+#define MAX_BIND_ADDRS 64
+#ifdef USE_IPV6
+static struct sockaddr_in6 bind_sa[MAX_BIND_ADDRS];
+#else /* USE_IPV6 */
+static struct sockaddr_in bind_sa[MAX_BIND_ADDRS];
+#endif /* USE_IPV6 */
+static int bind_sa_len[MAX_BIND_ADDRS];
+static int num_bind_sa, next_bind_sa;
+
+
+static void
+lookup_address( char* hostname, unsigned short port )
+    {
+    if ( ! resolve_address( hostname, port ) )
+	exit( 1 );
+    }
+
+
+/* Looks hostname up into sa; returns 0, having said why, if it can't. */
+static int
+resolve_address( char* hostname, unsigned short port )
+    {
+#ifdef USE_IPV6
+    struct addrinfo hints;
+    char portstr[10];
+    int gaierr;
+    struct addrinfo* ai;
+    struct addrinfo* ai2;
+    struct addrinfo* aiv4;
+    struct addrinfo* aiv6;
+#else /* USE_IPV6 */
+    struct hostent *he;
+#endif /* USE_IPV6 */
+
+    (void) memset( (void*) &sa, 0, sizeof(sa) );
+
+#ifdef USE_IPV6
+
+    (void) memset( &hints, 0, sizeof(hints) );
+    hints.ai_family = PF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    (void) snprintf( portstr, sizeof(portstr), "%d", (int) port );
+    if ( (gaierr = getaddrinfo( hostname, portstr, &hints, &ai )) != 0 )
+	{
+	(void) fprintf(
+	    stderr, "%s: getaddrinfo %s - %s\n", argv0, hostname,
+	    gai_strerror( gaierr ) );
+	return 0;
+	}
+
+    /* Find the first IPv4 and IPv6 entries. */
+    aiv4 = (struct addrinfo*) 0;
+    aiv6 = (struct addrinfo*) 0;
+    for ( ai2 = ai; ai2 != (struct addrinfo*) 0; ai2 = ai2->ai_next )
+	{
+	switch ( ai2->ai_family )
+	    {
+	    case AF_INET: 
+	    if ( aiv4 == (struct addrinfo*) 0 )
+		aiv4 = ai2;
+	    break;
+	    case AF_INET6:
+	    if ( aiv6 == (struct addrinfo*) 0 )
+		aiv6 = ai2;
+	    break;
+	    }
+	}
+
+    /* If there's an IPv4 address, use that, otherwise try IPv6. */
+    if ( aiv4 != (struct addrinfo*) 0 )
+	{
+	if ( sizeof(sa) < aiv4->ai_addrlen )
+	    {
+	    (void) fprintf(
+		stderr, "%s - sockaddr too small (%lu < %lu)\n",
+		hostname, (unsigned long) sizeof(sa),
+		(unsigned long) aiv4->ai_addrlen );
+	    return 0;
+	    }
+	sock_family = aiv4->ai_family;
+	sock_type = aiv4->ai_socktype;
+	sock_protocol = aiv4->ai_protocol;
+	sa_len = aiv4->ai_addrlen;
+	(void) memmove( &sa, aiv4->ai_addr, sa_len );
+	freeaddrinfo( ai );
+	return 1;
+	}
+    if ( aiv6 != (struct addrinfo*) 0 )
+	{
+	if ( sizeof(sa) < aiv6->ai_addrlen )
+	    {
+	    (void) fprintf(
+		stderr, "%s - sockaddr too small (%lu < %lu)\n",
+		hostname, (unsigned long) sizeof(sa),
+		(unsigned long) aiv6->ai_addrlen );
+	    return 0;
+	    }
+	sock_family = aiv6->ai_family;
+	sock_type = aiv6->ai_socktype;
+	sock_protocol = aiv6->ai_protocol;
+	sa_len = aiv6->ai_addrlen;
+	(void) memmove( &sa, aiv6->ai_addr, sa_len );
+	freeaddrinfo( ai );
+	return 1;
+	}
+
+    (void) fprintf(
+	stderr, "%s: no valid address found for host %s\n", argv0, hostname );
+    freeaddrinfo( ai );
+    return 0;
+
+#else /* USE_IPV6 */
+
+    he = gethostbyname( hostname );
+    if ( he == (struct hostent*) 0 )
+	{
+	(void) fprintf( stderr, "%s: unknown host - %s\n", argv0, hostname );
+	return 0;
+	}
+    sock_family = sa.sin_family = he->h_addrtype;
+    sock_type = SOCK_STREAM;
+    sock_protocol = 0;
+    sa_len = sizeof(sa);
+    (void) memmove( &sa.sin_addr, he->h_addr, he->h_length );
+    sa.sin_port = htons( port );
+    return 1;
+
+#endif /* USE_IPV6 */
+
+    }
+
+
+static void
+lookup_unix_path( void )
+    {
+    (void) memset( (void*) &sun_sa, 0, sizeof(sun_sa) );
+    sun_sa.sun_family = AF_UNIX;
+    (void) strncpy( sun_sa.sun_path, url_unix_path, sizeof(sun_sa.sun_path) - 1 );
+    sock_family = AF_UNIX;
+    sock_type = SOCK_STREAM;
+    sock_protocol = 0;
+    sa_len = sizeof(sun_sa);
+    }
+
+
+#ifdef USE_SSL
+/* Asks the -proxy for a tunnel to the origin.  Returns 0 if it won't
+** give one.
+*/
+static int
+open_tunnel( void )
+    {
+    char buf[2000];
+    int b, n, r;
+    char* cp;
+
+    b = snprintf(
+	buf, sizeof(buf), "CONNECT %.500s:%d HTTP/1.1\r\nHost: %.500s:%d\r\n\r\n",
+	url_host, (int) url_port, url_host, (int) url_port );
+    if ( write( conn_fd, buf, b ) != b )
+	{
+	perror( "write" );
+	return 0;
+	}
+
+    /* The proxy sends nothing after its headers until we speak TLS. */
+    for ( n = 0; ; n += r )
+	{
+	if ( n >= sizeof(buf) - 1 )
+	    {
+	    (void) fprintf( stderr, "%s: proxy response too long\n", url );
+	    return 0;
+	    }
+	r = read( conn_fd, &buf[n], sizeof(buf) - 1 - n );
+	if ( r < 0 )
+	    {
+	    perror( "read" );
+	    return 0;
+	    }
+	if ( r == 0 )
+	    {
+	    (void) fprintf( stderr, "%s: proxy closed the connection\n", url );
+	    return 0;
+	    }
+	buf[n + r] = '\0';
+	if ( strstr( buf, "\r\n\r\n" ) != (char*) 0 )
+	    break;
+	}
+    cp = strchr( buf, ' ' );
+    if ( strncmp( buf, "HTTP/", 5 ) != 0 || cp == (char*) 0 || atoi( cp + 1 ) / 100 != 2 )
+	{
+	buf[strcspn( buf, "\r\n" )] = '\0';
+	(void) fprintf( stderr, "%s: proxy refused CONNECT - %s\n", url, buf );
+	return 0;
+	}
+    return 1;
+    }
+#endif /* USE_SSL */
+
+
+static void
+target_save( target* t )
+    {
+    t->url = url;
+    t->protocol = url_protocol;
+    (void) strcpy( t->host, url_host );
+    t->port = url_port;
+    t->is_unix = url_unix;
+    t->filename = url_filename;
+    t->method = method;
+    t->vhost = vhost;
+    t->body_len = req_body_len;
+    t->tm = url_tm;
+    t->templated = url_templated;
+    t->sa = sa;
+    t->sun_sa = sun_sa;
+    t->sa_len = sa_len;
+    t->sock_family = sock_family;
+    t->sock_type = sock_type;
+    t->sock_protocol = sock_protocol;
+    }
+
+
+static void
+target_load( target* t )
+    {
+    url = t->url;
+    url_protocol = t->protocol;
+    (void) strcpy( url_host, t->host );
+    url_port = t->port;
+    url_unix = t->is_unix;
+    url_filename = t->filename;
+    method = t->method;
+    vhost = t->vhost;
+    req_body_len = t->body_len;
+    url_tm = t->tm;
+    url_templated = t->templated;
+    sa = t->sa;
+    sun_sa = t->sun_sa;
+    sa_len = t->sa_len;
+    sock_family = t->sock_family;
+    sock_type = t->sock_type;
+    sock_protocol = t->sock_protocol;
+    }
+
+
+/* Sets up the -ab targets: A is the URL as given, B the -ab URL, or the
+** same URL with the -ab vhost.
+*/
+static void
+ab_init( void )
+    {
+    target_save( &ab_targets[0] );
+    if ( strstr( ab_arg, "://" ) != (char*) 0 )
+	{
+	url = ab_arg;
+	parse_url();
+	url_templated = tm_compile( &url_tm, url_filename ) > 0;
+	if ( url_unix )
+	    lookup_unix_path();
+	else if ( ! do_proxy )
+	    lookup_address( url_host, url_port );
+	}
+    else
+	vhost = ab_arg;
+    target_save( &ab_targets[1] );
+    target_load( &ab_targets[0] );
+    }
+
+
+/* Points the probes, and their statistics, at one side of -ab. */
+static void
+ab_use( int side )
+    {
+    ab_side = side;
+    target_load( &ab_targets[side] );
+    group_stats = &ab_stats[side];
+    }
+
+
+/* Points the probe at resp_location, resolved against the current URL.
+** Returns 0 if it's somewhere we can't go, and the redirect is then the
+** final response, or -1 if its host won't resolve, which fails the probe.
+** Only 307 and 308 repeat the method and body.  A hop to another origin
+** closes any connection left open for reuse.
+*/
+static int
+follow_location( void )
+    {
+    char next[sizeof(hop_url)];
+    char old_host[sizeof(url_host)];
+    unsigned short old_port;
+    int old_protocol;
+    char* loc = resp_location;
+    char* cp;
+    int scheme_len, origin_len, dir_len, path_len, n;
+
+    /* The fragment is only for the client. */
+    resp_location[strcspn( resp_location, "#" )] = '\0';
+
+    /* The scheme, the origin, the path up to its last slash, and the
+    ** whole path without the query.
+    */
+    cp = strstr( url, "://" );
+    if ( cp == (char*) 0 )
+	return 0;
+    scheme_len = cp - url + 1;
+    origin_len = cp + 3 - url;
+    origin_len += strcspn( url + origin_len, "/" );
+    for ( cp = url + origin_len, dir_len = origin_len; *cp != '\0' && *cp != '?' && *cp != '#'; ++cp )
+	if ( *cp == '/' )
+	    dir_len = cp - url + 1;
+    path_len = cp - url;
+
+    if ( strncmp( loc, "http://", 7 ) == 0 || strncmp( loc, "https://", 8 ) == 0 )
+	{
+#ifndef USE_SSL
+	if ( loc[4] == 's' )
+	    return 0;
+#endif
+	if ( url_unix )
+	    return 0;
+	n = snprintf( next, sizeof(next), "%s", loc );
+	}
+    else if ( loc[0] == '/' && loc[1] == '/' )
+	{
+	if ( url_unix )
+	    return 0;
+	n = snprintf( next, sizeof(next), "%.*s%s", scheme_len, url, loc );
+	}
+    else if ( loc[0] == '/' )
+	n = snprintf( next, sizeof(next), "%.*s%s", origin_len, url, loc );
+    else if ( strstr( loc, "://" ) != (char*) 0 )
+	return 0;
+    /* RFC 3986 5.2.2: an empty or query-only reference keeps the path. */
+    else if ( loc[0] == '\0' || loc[0] == '?' )
+	n = snprintf(
+	    next, sizeof(next), "%.*s%s%s", path_len, url,
+	    path_len == origin_len ? "/" : "", loc );
+    else
+	n = snprintf(
+	    next, sizeof(next), "%.*s%s%s", dir_len, url,
+	    dir_len == origin_len ? "/" : "", loc );
+    if ( n >= sizeof(next) )
+	return 0;
+
+    if ( ! hop_moved )
+	{
+	target_save( &home );
+	hop_moved = 1;
+	}
+    old_protocol = url_protocol;
+    (void) strcpy( old_host, url_host );
+    old_port = url_port;
+    (void) strcpy( hop_url, next );
+    url = hop_url;
+    parse_url();
+    url_templated = 0;
+    if ( resp_status != 307 && resp_status != 308 )
+	{
+	method = (char*) 0;
+	req_body_len = 0;
+	}
+    if ( url_protocol != old_protocol || url_port != old_port ||
+	 strcmp( url_host, old_host ) != 0 )
+	{
+	vhost = (char*) 0;
+	close_connection();
+	if ( ! do_proxy && ! resolve_address( url_host, url_port ) )
+	    return -1;
+	}
+    return 1;
+    }
+
+
+/* Puts the probe's own URL and address back after a redirect chain. */
+static void
+follow_restore( void )
+    {
+    target_load( &home );
+    hop_moved = 0;
+    }
+
+
+static int
+open_client_socket( void )
+    {
+    int sockfd;
+    int flag = 1;
+
+    sockfd = socket( sock_family, sock_type, sock_protocol );
+    if ( sockfd < 0 )
+	{
+	perror( "socket" );
+	return -1;
+	}
+    /* So a timeout during connect() closes it. */
+    conn_fd = sockfd;
+
+    if ( do_timestamps )
+	enable_timestamps( sockfd );
+    if ( do_lowjitter )
+	tune_socket( sockfd );
+
+    if (!nagle && sock_family != AF_UNIX)
+    	{
+		if (setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, (char*)&flag, sizeof flag) <0)
+			{
+			perror( "TCP_NODELAY" );
+			(void) close( sockfd );
+			return -1;
+			}
+    	}
+
+#ifdef HAVE_TCP_INFO
+    if ( do_tfo )
+	{
+	/* connect() returns at once and the SYN goes out with the first
+	** write, carrying the request if the kernel has a cookie cached
+	** for this server.
+	*/
+	if ( setsockopt(
+		 sockfd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, (char*) &flag,
+		 sizeof(flag) ) < 0 )
+	    {
+	    perror( "TCP_FASTOPEN_CONNECT" );
+	    (void) close( sockfd );
+	    return -1;
+	    }
+	}
+#endif /* HAVE_TCP_INFO */
+
+    /* A small receive buffer keeps the window small for -slowread.  It
+    ** has to be set before connect() to affect window scaling.
+    */
+    if ( rcvbuf > 0 )
+	if ( setsockopt(
+		 sockfd, SOL_SOCKET, SO_RCVBUF, (void*) &rcvbuf,
+		 sizeof(rcvbuf) ) < 0 )
+	    perror( "SO_RCVBUF" );
+
+    if ( num_bind_sa > 0 && ! bind_client_socket( sockfd ) )
+	{
+	(void) close( sockfd );
+	return -1;
+	}
+
+    if ( connect(
+	     sockfd, url_unix ? (struct sockaddr*) &sun_sa : (struct sockaddr*) &sa,
+	     sa_len ) < 0 )
+	{
+	int err = errno;
+	perror( "connect" );
+	if ( err == EADDRNOTAVAIL || err == EADDRINUSE )
+	    count_port_failure();
+	(void) close( sockfd );
+	return -1;
+	}
+
+    return sockfd;
+    }
+
+
+/* Resolves the comma-separated -bind list, in the target's family. */
+static void
+lookup_bind_addresses( void )
+    {
+    char* cp;
+    char* next;
+#ifdef USE_IPV6
+    struct addrinfo hints;
+    struct addrinfo* ai;
+    int gaierr;
+#else /* USE_IPV6 */
+    struct hostent* he;
+#endif /* USE_IPV6 */
+
+    num_bind_sa = 0;
+    for ( cp = bind_list; cp != (char*) 0 && *cp != '\0'; cp = next )
+	{
+	next = strchr( cp, ',' );
+	if ( next != (char*) 0 )
+	    *next++ = '\0';
+	if ( num_bind_sa >= MAX_BIND_ADDRS )
+	    {
+	    (void) fprintf(
+		stderr, "%s: too many -bind addresses, max is %d\n", argv0,
+		MAX_BIND_ADDRS );
+	    exit( 1 );
+	    }
+	(void) memset( (void*) &bind_sa[num_bind_sa], 0, sizeof(bind_sa[0]) );
+#ifdef USE_IPV6
+	(void) memset( &hints, 0, sizeof(hints) );
+	hints.ai_family = sock_family;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICHOST | AI_PASSIVE;
+	if ( (gaierr = getaddrinfo( cp, (char*) 0, &hints, &ai )) != 0 )
+	    {
+	    (void) fprintf(
+		stderr, "%s: bind address %s - %s\n", argv0, cp,
+		gai_strerror( gaierr ) );
+	    exit( 1 );
+	    }
+	if ( sizeof(bind_sa[0]) < ai->ai_addrlen )
+	    {
+	    (void) fprintf(
+		stderr, "%s - sockaddr too small (%lu < %lu)\n",
+		cp, (unsigned long) sizeof(bind_sa[0]),
+		(unsigned long) ai->ai_addrlen );
+	    exit( 1 );
+	    }
+	bind_sa_len[num_bind_sa] = ai->ai_addrlen;
+	(void) memmove( &bind_sa[num_bind_sa], ai->ai_addr, ai->ai_addrlen );
+	freeaddrinfo( ai );
+#else /* USE_IPV6 */
+	he = gethostbyname( cp );
+	if ( he == (struct hostent*) 0 || he->h_addrtype != sock_family )
+	    {
+	    (void) fprintf( stderr, "%s: bad bind address - %s\n", argv0, cp );
+	    exit( 1 );
+	    }
+	bind_sa[num_bind_sa].sin_family = he->h_addrtype;
+	(void) memmove( &bind_sa[num_bind_sa].sin_addr, he->h_addr, he->h_length );
+	bind_sa_len[num_bind_sa] = sizeof(bind_sa[0]);
+#endif /* USE_IPV6 */
+	++num_bind_sa;
+	}
+    next_bind_sa = 0;
+    }
+
+
+/* Binds to the next -bind address.  IP_BIND_ADDRESS_NO_PORT defers
+** picking the port until connect(), when the kernel knows the whole
+** four-tuple and can share a port across destinations.
+*/
+static int
+bind_client_socket( int sockfd )
+    {
+    int i = next_bind_sa;
+
+    next_bind_sa = ( next_bind_sa + 1 ) % num_bind_sa;
+#ifdef IP_BIND_ADDRESS_NO_PORT
+    if ( sock_family == AF_INET )
+	{
+	int on = 1;
+	(void) setsockopt(
+	    sockfd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, (void*) &on,
+	    sizeof(on) );
+	}
+#endif /* IP_BIND_ADDRESS_NO_PORT */
+    if ( bind( sockfd, (struct sockaddr*) &bind_sa[i], bind_sa_len[i] ) < 0 )
+	{
+	int err = errno;
+	perror( "bind" );
+	if ( err == EADDRINUSE || err == EADDRNOTAVAIL )
+	    count_port_failure();
+	return 0;
+	}
+    return 1;
+    }
+
+
+static void
+count_port_failure( void )
+    {
+    stats_begin();
+    ++st->port_failures;
+    stats_end();
+    }
+
+
+static int
+handle_read( void )
+    {
+    static char big_buf[TP_BIG_READ];
+    char small_buf[5000];
+    char* buf;
+    int bytes_to_read, bytes_read, bytes_handled;
+
+    /* Bulk transfers read in big chunks so the client isn't the limit. */
+    if ( tp_period > 0 )
+	{
+	buf = big_buf;
+	bytes_to_read = sizeof(big_buf);
+	}
+    else
+	{
+	buf = small_buf;
+	bytes_to_read = sizeof(small_buf);
+	}
+
+    /* Slow readers take a tenth of a second's worth at a time. */
+    if ( slow_rate > 0 )
+	bytes_to_read = min( bytes_to_read, max( slow_rate / 10, 1 ) );
+
+    for (;;)
+	{
+	bytes_read = conn_read( buf, bytes_to_read );
+	if ( bytes_read < 0 )
+	    {
+	    perror( "read" );
+	    close_connection();
+	    return 0;
+	    }
+	if ( ! got_response )
+	    {
+	    got_response = 1;
+	    (void) gettimeofday( &response_at, (struct timezone*) 0 );
+	    }
+	if ( slow_rate > 0 && bytes_read > 0 )
+	    slow_pace( bytes_read );
+	/* The idle timeout runs from one read to the next; after the
+	** first byte the rest of the probe is at least out of TTFB.
+	*/
+	if ( bytes_read > 0 && ( to_limit[TO_IDLE] > 0 || bytes == 0 ) )
+	    timeout_phase( TO_IDLE );
+	if ( bytes_read == 0 )
+	    {
+	    finish_probe();
+	    close_connection();
+	    (void) gettimeofday( &finished_at, (struct timezone*) 0 );
+	    return 1;
+	    }
+
+	for ( bytes_handled = 0; bytes_handled < bytes_read; ++bytes_handled )
+	    {
+	    if ( conn_state != ST_DATA )
+		header_byte( buf[bytes_handled] );
+	    switch ( conn_state )
+		{
+		case ST_BOL:
+		switch ( buf[bytes_handled] )
+		    {
+		    case '\n':
+		    conn_state = ST_LF;
+		    break;
+		    case '\r':
+		    conn_state = ST_CR;
+		    break;
+		    case 'C': case 'c':
+		    conn_state = ST_C;
+		    break;
+		    default:
+		    conn_state = ST_TEXT;
+		    break;
+		    }
+		break;
+
+		case ST_TEXT:
+		switch ( buf[bytes_handled] )
+		    {
+		    case '\n':
+		    conn_state = ST_LF;
+		    break;
+		    case '\r':
+		    conn_state = ST_CR;
+		    break;
+		    default:
+		    break;
+		    }
+		break;
+
+		case ST_LF:
+		switch ( buf[bytes_handled] )
+		    {
+		    case '\n':
+		    conn_state = ST_DATA;
+		    break;
+		    case '\r':
+		    conn_state = ST_CR;
+		    break;
+		    case 'C': case 'c':
+		    conn_state = ST_C;
+		    break;
+		    default:
+		    conn_state = ST_TEXT;
+		    break;
+		    }
+		break;
+
+		case ST_CR:
+		switch ( buf[bytes_handled] )
+		    {
+		    case '\n':
+		    conn_state = ST_CRLF;
+		    break;
+		    case '\r':
+		    conn_state = ST_DATA;
+		    break;
+		    case 'C': case 'c':
+		    conn_state = ST_C;
+		    break;
+		    default:
+		    conn_state = ST_TEXT;
+		    break;
+		    }
+		break;
+
+		case ST_CRLF:
+		switch ( buf[bytes_handled] )
+		    {
+		    case '\n':
+		    conn_state = ST_DATA;
+		    break;
+		    case '\r':
+		    conn_state = ST_CRLFCR;
+		    break;
+		    case 'C': case 'c':
+		    conn_state = ST_C;
+		    break;
+		    default:
+		    conn_state = ST_TEXT;
+		    break;
+		    }
+		break;
+
+		case ST_CRLFCR:
+		switch ( buf[bytes_handled] )
+		    {
+		    case '\n': case '\r':
+		    conn_state = ST_DATA;
+		    break;
+		    case 'C': case 'c':
+		    conn_state = ST_C;
+		    break;
+		    default:
+		    conn_state = ST_TEXT;
+		    break;
+		    }
+		break;
+
+		case ST_C:
+		switch ( buf[bytes_handled] )
+		    {
+		    case 'O': case 'o':
+		    conn_state = ST_CO;
+		    break;
+		    case '\n':
+		    conn_state = ST_LF;
+		    break;
+		    case '\r':
+		    conn_state = ST_CR;
+		    break;
+		    default:
+		    conn_state = ST_TEXT;
+		    break;
+		    }
+		break;
+
+		case ST_CO:
+		switch ( buf[bytes_handled] )
+		    {
+		    case 'N': case 'n':
+		    conn_state = ST_CON;
+		    break;
+		    case '\n':
+		    conn_state = ST_LF;
+		    break;
+		    case '\r':
+		    conn_state = ST_CR;
+		    break;
+		    default:
+		    conn_state = ST_TEXT;
+		    break;
+		    }
+		break;
+
+		case ST_CON:
+		switch ( buf[bytes_handled] )
+		    {
+		    case 'T': case 't':
+		    conn_state = ST_CONT;
+		    break;
+		    case '\n':
+		    conn_state = ST_LF;
+		    break;
+		    case '\r':
+		    conn_state = ST_CR;
+		    break;
+		    default:
+		    conn_state = ST_TEXT;
+		    break;
+		    }
+		break;
+
+		case ST_CONT:
+		switch ( buf[bytes_handled] )
+		    {
+		    case 'E': case 'e':
+		    conn_state = ST_CONTE;
+		    break;
+		    case '\n':
+		    conn_state = ST_LF;
+		    break;
+		    case '\r':
+		    conn_state = ST_CR;
+		    break;
+		    default:
+		    conn_state = ST_TEXT;
+		    break;
+		    }
+		break;
+
+		case ST_CONTE:
+		switch ( buf[bytes_handled] )
+		    {
+		    case 'N': case 'n':
+		    conn_state = ST_CONTEN;
+		    break;
+		    case '\n':
+		    conn_state = ST_LF;
+		    break;
+		    case '\r':
+		    conn_state = ST_CR;
+		    break;
+		    default:
+		    conn_state = ST_TEXT;
+		    break;
+		    }
+		break;
+
+		case ST_CONTEN:
+		switch ( buf[bytes_handled] )
+		    {
+		    case 'T': case 't':
+		    conn_state = ST_CONTENT;
+		    break;
+		    case '\n':
+		    conn_state = ST_LF;
+		    break;
+		    case '\r':
+		    conn_state = ST_CR;
+		    break;
+		    default:
+		    conn_state = ST_TEXT;
+		    break;
+		    }
+		break;
+
+		case ST_CONTENT:
+		switch ( buf[bytes_handled] )
+		    {
+		    case '-':
+		    conn_state = ST_CONTENT_;
+		    break;
+		    case '\n':
+		    conn_state = ST_LF;
+		    break;
+		    case '\r':
+		    conn_state = ST_CR;
+		    break;
+		    default:
+		    conn_state = ST_TEXT;
+		    break;
+		    }
+		break;
+
+		case ST_CONTENT_:
+		switch ( buf[bytes_handled] )
+		    {
+		    case 'L': case 'l':
+		    conn_state = ST_CONTENT_L;
+		    break;
+		    case '\n':
+		    conn_state = ST_LF;
+		    break;
+		    case '\r':
+		    conn_state = ST_CR;
+		    break;
+		    default:
+		    conn_state = ST_TEXT;
+		    break;
+		    }
+		break;
+
+		case ST_CONTENT_L:
+		switch ( buf[bytes_handled] )
+		    {
+		    case 'E': case 'e':
+		    conn_state = ST_CONTENT_LE;
+		    break;
+		    case '\n':
+		    conn_state = ST_LF;
+		    break;
+		    case '\r':
+		    conn_state = ST_CR;
+		    break;
+		    default:
+		    conn_state = ST_TEXT;
+		    break;
+		    }
+		break;
+
+		case ST_CONTENT_LE:
+		switch ( buf[bytes_handled] )
+		    {
+		    case 'N': case 'n':
+		    conn_state = ST_CONTENT_LEN;
+		    break;
+		    case '\n':
+		    conn_state = ST_LF;
+		    break;
+		    case '\r':
+		    conn_state = ST_CR;
+		    break;
+		    default:
+		    conn_state = ST_TEXT;
+		    break;
+		    }
+		break;
+
+		case ST_CONTENT_LEN:
+		switch ( buf[bytes_handled] )
+		    {
+		    case 'G': case 'g':
+		    conn_state = ST_CONTENT_LENG;
+		    break;
+		    case '\n':
+		    conn_state = ST_LF;
+		    break;
+		    case '\r':
+		    conn_state = ST_CR;
+		    break;
+		    default:
+		    conn_state = ST_TEXT;
+		    break;
+		    }
+		break;
+
+		case ST_CONTENT_LENG:
+		switch ( buf[bytes_handled] )
+		    {
+		    case 'T': case 't':
+		    conn_state = ST_CONTENT_LENGT;
+		    break;
+		    case '\n':
+		    conn_state = ST_LF;
+		    break;
+		    case '\r':
+		    conn_state = ST_CR;
+		    break;
+		    default:
+		    conn_state = ST_TEXT;
+		    break;
+		    }
+		break;
+
+		case ST_CONTENT_LENGT:
+		switch ( buf[bytes_handled] )
+		    {
+		    case 'H': case 'h':
+		    conn_state = ST_CONTENT_LENGTH;
+		    break;
+		    case '\n':
+		    conn_state = ST_LF;
+		    break;
+		    case '\r':
+		    conn_state = ST_CR;
+		    break;
+		    default:
+		    conn_state = ST_TEXT;
+		    break;
+		    }
+		break;
+
+		case ST_CONTENT_LENGTH:
+		switch ( buf[bytes_handled] )
+		    {
+		    case ':':
+		    conn_state = ST_CONTENT_LENGTH_COLON;
+		    break;
+		    case '\n':
+		    conn_state = ST_LF;
+		    break;
+		    case '\r':
+		    conn_state = ST_CR;
+		    break;
+		    default:
+		    conn_state = ST_TEXT;
+		    break;
+		    }
+		break;
+
+		case ST_CONTENT_LENGTH_COLON:
+		switch ( buf[bytes_handled] )
+		    {
+		    case ' ': case '\t':
+		    conn_state = ST_CONTENT_LENGTH_COLON_WHITESPACE;
+		    break;
+		    case '\n':
+		    conn_state = ST_LF;
+		    break;
+		    case '\r':
+		    conn_state = ST_CR;
+		    break;
+		    default:
+		    conn_state = ST_TEXT;
+		    break;
+		    }
+		break;
+
+		case ST_CONTENT_LENGTH_COLON_WHITESPACE:
+		switch ( buf[bytes_handled] )
+		    {
+		    case ' ': case '\t':
+		    break;
+		    case '0': case '1': case '2': case '3': case '4':
+		    case '5': case '6': case '7': case '8': case '9':
+		    content_length = buf[bytes_handled] - '0';
+		    conn_state = ST_CONTENT_LENGTH_COLON_WHITESPACE_NUM;
+		    break;
+		    case '\n':
+		    conn_state = ST_LF;
+		    break;
+		    case '\r':
+		    conn_state = ST_CR;
+		    break;
+		    default:
+		    conn_state = ST_TEXT;
+		    break;
+		    }
+		break;
+
+		case ST_CONTENT_LENGTH_COLON_WHITESPACE_NUM:
+		switch ( buf[bytes_handled] )
+		    {
+		    case '0': case '1': case '2': case '3': case '4':
+		    case '5': case '6': case '7': case '8': case '9':
+		    content_length =
+			content_length * 10 + buf[bytes_handled] - '0';
+		    break;
+		    case '\n':
+		    conn_state = ST_LF;
+		    break;
 		    case '\r':
 		    conn_state = ST_CR;
 		    break;
@@ -860,343 +4356,2443 @@ handle_read( void )
 		    }
 		break;
 
-		case ST_CO:
-		switch ( buf[bytes_handled] )
-		    {
-		    case 'N': case 'n':
-		    conn_state = ST_CON;
-		    break;
-		    case '\n':
-		    conn_state = ST_LF;
-		    break;
-		    case '\r':
-		    conn_state = ST_CR;
-		    break;
-		    default:
-		    conn_state = ST_TEXT;
-		    break;
-		    }
-		break;
+		case ST_DATA:
+		if ( body_needle != (char*) 0 || do_body_hash ||
+		     accept_encoding != (char*) 0 || ( conn_keep && resp_chunked ) )
+		    body_data( &buf[bytes_handled], bytes_read - bytes_handled );
+		bytes += bytes_read - bytes_handled;
+		if ( tp_period > 0 )
+		    tp_account( bytes_read - bytes_handled );
+		bytes_handled = bytes_read;
+		break;
+		}
+	    }
+	if ( conn_state == ST_DATA && resp_complete() )
+	    {
+	    finish_probe();
+	    /* Keep it for a -follow hop, or the next probe with
+	    ** -proxy-keepalive, if the server will.
+	    */
+	    if ( ! ( conn_keep && ! resp_close &&
+		     ( proxy_keep || is_redirect( resp_status ) ) ) )
+		close_connection();
+	    (void) gettimeofday( &finished_at, (struct timezone*) 0 );
+	    return 1;
+	    }
+	}
+    return 1;
+    }
+
+
+/* Whether the whole response has been read, short of EOF.  On a
+** keep-alive connection that's also the end of a chunked body, or of a
+** response that has none.
+*/
+static int
+resp_complete( void )
+    {
+    if ( conn_keep )
+	{
+	if ( ( method != (char*) 0 && strcmp( method, "HEAD" ) == 0 ) ||
+	     resp_status == 204 || resp_status == 304 )
+	    return 1;
+	if ( resp_chunked )
+	    return chunk_state == CK_DONE;
+	}
+    return content_length != -1 && bytes >= content_length;
+    }
+
+
+/* Reads from the connection.  With -lowjitter the socket is
+** non-blocking and this spins until data shows up.
+*/
+static int
+conn_read( char* buf, int len )
+    {
+    int r;
+
+    for (;;)
+	{
+	r = conn_read_once( buf, len );
+	if ( ! do_lowjitter || r >= 0 )
+	    return r;
+#ifdef USE_SSL
+	if ( url_protocol == PROTO_HTTPS )
+	    {
+	    switch ( SSL_get_error( ssl, r ) )
+		{
+		case SSL_ERROR_WANT_READ: case SSL_ERROR_WANT_WRITE:
+		continue;
+		}
+	    return r;
+	    }
+#endif
+	if ( errno != EAGAIN && errno != EWOULDBLOCK )
+	    return r;
+	}
+    }
+
+
+/* One read from the connection, plain or SSL.  With -timestamps the
+** first read of a response also picks up the kernel's receive timestamp.
+*/
+static int
+conn_read_once( char* buf, int len )
+    {
+#ifdef HAVE_SO_TIMESTAMPING
+    struct msghdr msg;
+    struct iovec iov;
+    char control[512];
+#ifdef USE_SSL
+    char peek;
+#endif
+    int r;
+
+    if ( do_timestamps && ! got_response )
+	{
+	(void) memset( (void*) &msg, 0, sizeof(msg) );
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+#ifdef USE_SSL
+	if ( url_protocol == PROTO_HTTPS )
+	    {
+	    /* SSL does its own reads, so just peek to get the stamp. */
+	    iov.iov_base = &peek;
+	    iov.iov_len = 1;
+	    if ( recvmsg( conn_fd, &msg, MSG_PEEK ) > 0 )
+		read_rx_timestamp( &msg );
+	    return SSL_read( ssl, buf, len );
+	    }
+#endif
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	r = recvmsg( conn_fd, &msg, 0 );
+	if ( r > 0 )
+	    read_rx_timestamp( &msg );
+	return r;
+	}
+#endif /* HAVE_SO_TIMESTAMPING */
+#ifdef USE_SSL
+    if ( url_protocol == PROTO_HTTPS )
+	return SSL_read( ssl, buf, len );
+#endif
+    return read( conn_fd, buf, len );
+    }
+
+
+/* Compiles s into t.  Placeholders are
+**   {seq}          the probe's sequence number
+**   {rand:n}       a random number from 0 to n-1
+**   {str:n}        n random letters and digits
+**   {pick:a,b,c}   one of the choices at random
+** and any other braces are literal.  Returns the number of placeholders.
+** Text parts point into s, so it has to stay around.
+*/
+static int
+tm_compile( template* t, char* s )
+    {
+    char* cp;
+    char* end;
+    tm_part* p;
+    int placeholders;
+
+    t->nparts = 0;
+    placeholders = 0;
+    for ( cp = s; *cp != '\0'; )
+	{
+	if ( t->nparts >= MAX_TM_PARTS )
+	    {
+	    (void) fprintf( stderr, "%s: template too complicated - %s\n", argv0, s );
+	    exit( 1 );
+	    }
+	p = &t->parts[t->nparts++];
+	end = strchr( cp, '}' );
+	if ( *cp == '{' && end != (char*) 0 &&
+	     tm_placeholder( p, cp + 1, end - cp - 1 ) )
+	    {
+	    ++placeholders;
+	    cp = end + 1;
+	    continue;
+	    }
+	p->type = TM_TEXT;
+	p->text = cp;
+	for ( ++cp; *cp != '\0' && *cp != '{'; ++cp )
+	    ;
+	p->len = cp - p->text;
+	}
+    return placeholders;
+    }
+
+
+/* Fills in p from the len chars of spec, if they are a placeholder. */
+static int
+tm_placeholder( tm_part* p, char* spec, int len )
+    {
+    char buf[1000];
+    char* cp;
+
+    if ( len >= sizeof(buf) )
+	return 0;
+    (void) memcpy( (void*) buf, (void*) spec, len );
+    buf[len] = '\0';
+    if ( strcmp( buf, "seq" ) == 0 )
+	p->type = TM_SEQ;
+    else if ( strncmp( buf, "rand:", 5 ) == 0 && atol( &buf[5] ) > 0 )
+	{
+	p->type = TM_RAND;
+	p->n = atol( &buf[5] );
+	}
+    else if ( strncmp( buf, "str:", 4 ) == 0 && atol( &buf[4] ) > 0 )
+	{
+	p->type = TM_STR;
+	p->n = atol( &buf[4] );
+	}
+    else if ( strncmp( buf, "pick:", 5 ) == 0 && buf[5] != '\0' )
+	{
+	p->type = TM_PICK;
+	p->text = strdup( &buf[5] );
+	if ( p->text == (char*) 0 )
+	    {
+	    (void) fprintf( stderr, "%s: out of memory\n", argv0 );
+	    exit( 1 );
+	    }
+	p->len = 1;
+	for ( cp = p->text; *cp != '\0'; ++cp )
+	    if ( *cp == ',' )
+		{
+		*cp = '\0';
+		++p->len;
+		}
+	}
+    else
+	return 0;
+    return 1;
+    }
+
+
+/* Expands t into buf, which always ends up NUL-terminated, and returns
+** the length.  No allocation, so it's cheap enough for every probe.
+*/
+static int
+tm_expand( template* t, char* buf, int size )
+    {
+    static char alnum[] =
+	"abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+    tm_part* p;
+    char* cp;
+    int i, k, n;
+
+    n = 0;
+    for ( i = 0; i < t->nparts && n < size - 1; ++i )
+	{
+	p = &t->parts[i];
+	switch ( p->type )
+	    {
+	    case TM_TEXT:
+	    k = min( p->len, size - 1 - n );
+	    (void) memcpy( (void*) &buf[n], (void*) p->text, k );
+	    n += k;
+	    break;
+
+	    case TM_SEQ:
+	    n = min( n + snprintf( &buf[n], size - n, "%ld", probe_seq ), size - 1 );
+	    break;
+
+	    case TM_RAND:
+	    n = min( n + snprintf( &buf[n], size - n, "%ld", random() % p->n ), size - 1 );
+	    break;
+
+	    case TM_STR:
+	    for ( k = 0; k < p->n && n < size - 1; ++k )
+		buf[n++] = alnum[random() % ( sizeof(alnum) - 1 )];
+	    break;
+
+	    case TM_PICK:
+	    cp = p->text;
+	    for ( k = random() % p->len; k > 0; --k )
+		cp += strlen( cp ) + 1;
+	    k = min( (int) strlen( cp ), size - 1 - n );
+	    (void) memcpy( (void*) &buf[n], (void*) cp, k );
+	    n += k;
+	    break;
+	    }
+	}
+    buf[n] = '\0';
+    return n;
+    }
+
+
+/* Collects response header lines and hands each one, without its line
+** ending, to handle_header().  Overlong lines are cut short.
+*/
+static void
+header_byte( char c )
+    {
+    if ( c == '\n' )
+	{
+	if ( hdr_len > 0 && hdr_line[hdr_len - 1] == '\r' )
+	    --hdr_len;
+	hdr_line[hdr_len] = '\0';
+	handle_header( hdr_line, hdr_len );
+	hdr_len = 0;
+	++hdr_lines;
+	}
+    else if ( hdr_len < sizeof(hdr_line) - 1 )
+	hdr_line[hdr_len++] = c;
+    }
+
+
+static void
+handle_header( char* line, int len )
+    {
+    char* value;
+    char* cp;
+    int n;
+
+    if ( hdr_lines == 0 )
+	{
+	/* The status line. */
+	if ( strncmp( line, "HTTP/", 5 ) == 0 &&
+	     ( cp = strchr( line, ' ' ) ) != (char*) 0 )
+	    resp_status = atoi( cp + 1 );
+	/* HTTP/1.0 servers close unless they say otherwise. */
+	resp_close = strncmp( line, "HTTP/1.0", 8 ) == 0;
+	if ( resp_status == 304 )
+	    cache_class = CC_REVALIDATED;
+	return;
+	}
+    /* First, and without returning, since the -backend header may be
+    ** one of those handled below.
+    */
+    if ( backend_header != (char*) 0 &&
+	 header_is( line, len, backend_header, &value ) )
+	{
+	/* Looked up straight from the line; only a new backend is copied. */
+	for ( n = strlen( value ); n > 0 && isspace( (unsigned char) value[n - 1] ); --n )
+	    ;
+	resp_backend = key_lookup( &backends, value, n, &resp_backend_name );
+	}
+    if ( follow_max > 0 && header_is( line, len, "Location", &value ) )
+	{
+	(void) snprintf( resp_location, sizeof(resp_location), "%s", value );
+	return;
+	}
+    if ( conn_keep && header_is( line, len, "Connection", &value ) )
+	{
+	if ( has_word( value, "close" ) )
+	    resp_close = 1;
+	else if ( has_word( value, "keep-alive" ) )
+	    resp_close = 0;
+	return;
+	}
+    if ( header_is( line, len, "Transfer-Encoding", &value ) )
+	{
+	resp_chunked = has_word( value, "chunked" );
+	return;
+	}
+    /* Without -compress the body is taken as it comes. */
+    if ( accept_encoding != (char*) 0 &&
+	 header_is( line, len, "Content-Encoding", &value ) )
+	{
+	if ( has_word( value, "gzip" ) || has_word( value, "x-gzip" ) )
+	    resp_encoding = ENC_GZIP;
+	else if ( has_word( value, "deflate" ) )
+	    resp_encoding = ENC_DEFLATE;
+	else if ( has_word( value, "br" ) )
+	    resp_encoding = ENC_BR;
+	else if ( ! has_word( value, "identity" ) )
+	    dec_failed = 1;
+	return;
+	}
+    if ( ! do_cache )
+	return;
+    if ( header_is( line, len, "Age", &value ) )
+	{
+	resp_age = atol( value );
+	if ( resp_age > 0 && cache_class == CC_UNKNOWN )
+	    cache_class = CC_HIT;
+	}
+    else if ( header_is( line, len, "X-Cache", &value ) )
+	{
+	/* Layered caches append, so the last entry is nearest to us. */
+	cp = strrchr( value, ',' );
+	x_cache_class = cache_token( cp != (char*) 0 ? cp + 1 : value );
+	}
+    else if ( header_is( line, len, "Cache-Status", &value ) )
+	{
+	/* RFC 9211: one entry per cache, the last one nearest to us. */
+	cp = strrchr( value, ',' );
+	if ( cp != (char*) 0 )
+	    value = cp + 1;
+	if ( has_word( value, "hit" ) )
+	    cache_status_class = CC_HIT;
+	else if ( has_word( value, "fwd" ) )
+	    cache_status_class = CC_MISS;
+	}
+    else if ( header_is( line, len, "ETag", &value ) )
+	(void) snprintf( resp_etag, sizeof(resp_etag), "%s", value );
+    else if ( header_is( line, len, "Last-Modified", &value ) )
+	(void) snprintf( resp_last_modified, sizeof(resp_last_modified), "%s", value );
+
+    /* The explicit headers win over Age, and a 304 over everything. */
+    if ( cache_class != CC_REVALIDATED )
+	{
+	if ( cache_status_class != CC_UNKNOWN )
+	    cache_class = cache_status_class;
+	else if ( x_cache_class != CC_UNKNOWN )
+	    cache_class = x_cache_class;
+	}
+    }
+
+
+/* Checks whether line is the header name, case-insensitively, and if so
+** points *valueP at the value.
+*/
+static int
+header_is( char* line, int len, char* name, char** valueP )
+    {
+    int n = strlen( name );
+
+    if ( len <= n || line[n] != ':' || strncasecmp( line, name, n ) != 0 )
+	return 0;
+    for ( *valueP = &line[n + 1]; **valueP == ' ' || **valueP == '\t'; ++*valueP )
+	;
+    return 1;
+    }
+
+
+/* Whether word appears in s as a whole word, ignoring case. */
+static int
+has_word( char* s, char* word )
+    {
+    int n = strlen( word );
+    char* cp;
+
+    for ( cp = s; *cp != '\0'; ++cp )
+	if ( strncasecmp( cp, word, n ) == 0 &&
+	     ( cp == s || ! isalnum( (unsigned char) cp[-1] ) ) &&
+	     ! isalnum( (unsigned char) cp[n] ) )
+	    return 1;
+    return 0;
+    }
+
+
+/* Classifies an X-Cache entry such as "HIT from edge-1" or "TCP_MISS". */
+static int
+cache_token( char* value )
+    {
+    char* cp;
+    int len;
+
+    while ( isspace( (unsigned char) *value ) )
+	++value;
+    /* Squid-style result codes go by their last part, so TCP_MEM_HIT is
+    ** a hit and TCP_REFRESH_MISS a miss.
+    */
+    if ( strncasecmp( value, "TCP_", 4 ) == 0 )
+	{
+	len = strcspn( value, " \t/:" );
+	for ( cp = &value[len]; cp[-1] != '_'; --cp )
+	    ;
+	len -= cp - value;
+	if ( len == 3 && strncasecmp( cp, "hit", 3 ) == 0 )
+	    return CC_HIT;
+	if ( len == 4 && strncasecmp( cp, "miss", 4 ) == 0 )
+	    return CC_MISS;
+	return CC_UNKNOWN;
+	}
+    if ( has_word( value, "hit" ) )
+	return CC_HIT;
+    if ( has_word( value, "miss" ) )
+	return CC_MISS;
+    return CC_UNKNOWN;
+    }
+
+
+static int
+conn_write( char* buf, int len )
+    {
+#ifdef USE_SSL
+    if ( url_protocol == PROTO_HTTPS )
+	return SSL_write( ssl, buf, len );
+#endif
+    return write( conn_fd, buf, len );
+    }
+
+
+static void
+handle_term( int sig )
+    {
+    terminate = 1;
+    }
+
+
+static void
+handle_alarm( int sig )
+    {
+    /* At startup there's no probe to abandon yet, whichever limit ran
+    ** out first.
+    */
+    if ( to_startup || to_phase == TO_DNS )
+	{
+	(void) fprintf( stderr, "%s: address lookup timed out\n", argv0 );
+	exit( 1 );
+	}
+    close_connection();
+    (void) fprintf( stderr, "%s: timed out (%s)\n", url, to_names[to_phase] );
+    probe_timed_out( to_phase );
+    siglongjmp( jb, 1 );
+    }
+
+
+/* Returns the phase for a -<phase>-timeout flag, or -1. */
+static int
+timeout_option( char* opt )
+    {
+    char buf[100];
+    int ph;
+
+    for ( ph = 0; ph < TO_TOTAL; ++ph )
+	{
+	(void) snprintf( buf, sizeof(buf), "-%s-timeout", to_names[ph] );
+	if ( strncmp( opt, buf, strlen( opt ) ) == 0 )
+	    return ph;
+	}
+    return -1;
+    }
+
+
+/* Starts the clock on the total timeout. */
+static void
+timeout_start( void )
+    {
+    long usecs = (long) ( timeout * 1000000.0 );
+
+    (void) gettimeofday( &to_deadline, (struct timezone*) 0 );
+    to_deadline.tv_sec += usecs / 1000000L;
+    to_deadline.tv_usec += usecs % 1000000L;
+    to_deadline.tv_sec += to_deadline.tv_usec / 1000000L;
+    to_deadline.tv_usec %= 1000000L;
+    }
+
+
+/* Arms the alarm on entering a phase. */
+static void
+timeout_phase( int phase )
+    {
+    struct timeval now;
+    struct itimerval it;
+    long long left;
+
+    (void) gettimeofday( &now, (struct timezone*) 0 );
+    left = delta_timeval( &now, &to_deadline );
+    to_phase = TO_TOTAL;
+    if ( to_limit[phase] > 0 && to_limit[phase] * 1000LL < left )
+	{
+	left = to_limit[phase] * 1000LL;
+	to_phase = phase;
+	}
+    if ( left < 1 )
+	left = 1;
+    (void) memset( (void*) &it, 0, sizeof(it) );
+    it.it_value.tv_sec = left / 1000000LL;
+    it.it_value.tv_usec = left % 1000000LL;
+    (void) setitimer( ITIMER_REAL, &it, (struct itimerval*) 0 );
+    }
+
+
+static void
+timeout_cancel( void )
+    {
+    struct itimerval it;
+
+    (void) memset( (void*) &it, 0, sizeof(it) );
+    (void) setitimer( ITIMER_REAL, &it, (struct itimerval*) 0 );
+    }
+
+
+static void
+close_connection( void )
+    {
+#ifdef USE_SSL
+    if ( ssl != (SSL*) 0 )
+	{
+	SSL_free( ssl );
+	ssl = (SSL*) 0;
+	}
+#endif
+    if ( conn_fd >= 0 )
+	{
+	(void) close( conn_fd );
+	conn_fd = -1;
+	}
+    }
+
+
+/* Reads TCP_INFO from the current connection.  At connect time only the
+** handshake retransmit count is kept; the final reading before close
+** fills in ti_values for the probe.
+*/
+static void
+capture_tcp_info( int at_connect )
+    {
+#ifdef HAVE_TCP_INFO
+    tcp_info_ext ti;
+    socklen_t len = sizeof(ti);
+
+    (void) memset( (void*) &ti, 0, sizeof(ti) );
+    if ( getsockopt( conn_fd, IPPROTO_TCP, TCP_INFO, (void*) &ti, &len ) < 0 )
+	return;
+    if ( at_connect )
+	{
+	ti_connect_retrans = ti.base.tcpi_total_retrans;
+	return;
+	}
+    ti_values[TI_RTT] = ti.base.tcpi_rtt / 1000.0;
+    ti_values[TI_MIN_RTT] = ti.min_rtt / 1000.0;
+    ti_values[TI_RETRANS] = ti.base.tcpi_total_retrans;
+    ti_values[TI_LOST] = ti.base.tcpi_lost;
+    ti_values[TI_CWND] = ti.base.tcpi_snd_cwnd;
+    ti_values[TI_RATE] = ti.delivery_rate * 8.0 / 1000000.0;
+    tfo_accepted = ( ti.base.tcpi_options & TCPI_OPT_SYN_DATA ) != 0;
+    got_tcp_info = 1;
+#endif /* HAVE_TCP_INFO */
+    }
+
+
+/* Sets up -lowjitter: pin to a CPU, measure the wakeup latency that
+** spinning saves, then lock memory and go real-time.
+*/
+static void
+init_lowjitter( void )
+    {
+#ifdef HAVE_SCHED_SETAFFINITY
+    cpu_set_t cpus;
+
+    if ( lowjitter_cpu < 0 )
+	lowjitter_cpu = sched_getcpu();
+    if ( lowjitter_cpu >= 0 )
+	{
+	CPU_ZERO( &cpus );
+	CPU_SET( lowjitter_cpu, &cpus );
+	if ( sched_setaffinity( 0, sizeof(cpus), &cpus ) < 0 )
+	    perror( "sched_setaffinity" );
+	}
+#endif /* HAVE_SCHED_SETAFFINITY */
+
+    measure_wakeup();
+
+    if ( mlockall( MCL_CURRENT|MCL_FUTURE ) < 0 )
+	perror( "mlockall" );
+    if ( lowjitter_rtprio > 0 )
+	{
+	struct sched_param sp;
+
+	(void) memset( (void*) &sp, 0, sizeof(sp) );
+	sp.sched_priority = lowjitter_rtprio;
+	if ( sched_setscheduler( 0, SCHED_FIFO, &sp ) < 0 )
+	    perror( "SCHED_FIFO" );
+	}
+    }
+
+
+/* Per-socket -lowjitter settings.  Busy polling above the sysctl
+** default needs CAP_NET_ADMIN, so failures are not fatal.
+*/
+static void
+tune_socket( int fd )
+    {
+#ifdef SO_BUSY_POLL
+    int usecs = 50;
+    int on = 1;
+
+    if ( setsockopt(
+	     fd, SOL_SOCKET, SO_BUSY_POLL, (void*) &usecs, sizeof(usecs) ) < 0 )
+	{
+	static int warned = 0;
+	if ( ! warned )
+	    perror( "SO_BUSY_POLL" );
+	warned = 1;
+	}
+#ifdef SO_PREFER_BUSY_POLL
+    (void) setsockopt(
+	fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, (void*) &on, sizeof(on) );
+#else
+    (void) on;
+#endif
+#endif /* SO_BUSY_POLL */
+    }
+
+
+#define WAKEUP_ROUNDS 100
+
+/* The loopback baseline for -lowjitter, over a local socketpair.  A
+** child on another CPU sleeps briefly, so we are sure to be waiting,
+** then sends its gettimeofday(); the median delay until our read
+** returns is measured once with a blocking read and once spinning on a
+** non-blocking one.
+*/
+static void
+measure_wakeup( void )
+    {
+    int sv[2];
+    pid_t pid;
+    char go;
+    struct timeval tv;
+    int i;
+
+    wakeup_blocking = wakeup_spinning = 0.0;
+#ifdef HAVE_SCHED_SETAFFINITY
+    if ( sysconf( _SC_NPROCESSORS_ONLN ) < 2 )
+	{
+	(void) fprintf(
+	    stderr, "%s: only one CPU, skipping the wakeup baseline\n", argv0 );
+	return;
+	}
+#endif
+    if ( socketpair( AF_UNIX, SOCK_STREAM, 0, sv ) < 0 )
+	{
+	perror( "socketpair" );
+	return;
+	}
+    pid = fork();
+    if ( pid < 0 )
+	{
+	perror( "fork" );
+	(void) close( sv[0] );
+	(void) close( sv[1] );
+	return;
+	}
+    if ( pid == 0 )
+	{
+#ifdef HAVE_SCHED_SETAFFINITY
+	cpu_set_t cpus;
+	int cpu;
+
+	CPU_ZERO( &cpus );
+	for ( cpu = 0; cpu < sysconf( _SC_NPROCESSORS_ONLN ) && cpu < CPU_SETSIZE; ++cpu )
+	    if ( cpu != lowjitter_cpu )
+		CPU_SET( cpu, &cpus );
+	(void) sched_setaffinity( 0, sizeof(cpus), &cpus );
+#endif
+	(void) close( sv[0] );
+	for ( i = 0; i < 2 * WAKEUP_ROUNDS; ++i )
+	    {
+	    if ( read( sv[1], &go, 1 ) != 1 )
+		break;
+	    (void) usleep( 1000 );
+	    (void) gettimeofday( &tv, (struct timezone*) 0 );
+	    if ( write( sv[1], &tv, sizeof(tv) ) != sizeof(tv) )
+		break;
+	    }
+	_exit( 0 );
+	}
+    (void) close( sv[1] );
+    wakeup_blocking = wakeup_median( sv[0], 0 );
+    wakeup_spinning = wakeup_median( sv[0], 1 );
+    (void) close( sv[0] );
+    (void) waitpid( pid, (int*) 0, 0 );
+    if ( ! quiet )
+	(void) printf(
+	    "lowjitter: loopback wakeup %g us blocking, %g us spinning\n",
+	    wakeup_blocking, wakeup_spinning );
+    }
+
+
+static int
+double_cmp( const void* a, const void* b )
+    {
+    double da = *(const double*) a;
+    double db = *(const double*) b;
+    return da < db ? -1 : da > db ? 1 : 0;
+    }
+
+
+static double
+wakeup_median( int fd, int spin )
+    {
+    double d[WAKEUP_ROUNDS];
+    struct timeval sent, now;
+    char go = 'g';
+    int flags, i, r;
+
+    flags = fcntl( fd, F_GETFL, 0 );
+    (void) fcntl( fd, F_SETFL, spin ? flags | O_NONBLOCK : flags & ~O_NONBLOCK );
+    for ( i = 0; i < WAKEUP_ROUNDS; ++i )
+	{
+	if ( write( fd, &go, 1 ) != 1 )
+	    return 0.0;
+	do
+	    r = read( fd, &sent, sizeof(sent) );
+	while ( r < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) );
+	(void) gettimeofday( &now, (struct timezone*) 0 );
+	if ( r != sizeof(sent) )
+	    return 0.0;
+	d[i] = delta_timeval( &sent, &now );
+	}
+    (void) fcntl( fd, F_SETFL, flags );
+    qsort( d, WAKEUP_ROUNDS, sizeof(d[0]), double_cmp );
+    return d[WAKEUP_ROUNDS / 2];
+    }
+
+
+/* Called just before a successful probe closes its socket: gathers the
+** per-connection kernel info, and with -linger0 arranges for the close
+** to send a RST so the port doesn't sit in TIME_WAIT.
+*/
+static void
+finish_probe( void )
+    {
+    struct linger lg;
+
+    if ( do_tcpinfo || do_tfo )
+	capture_tcp_info( 0 );
+    if ( do_timestamps )
+	read_tx_timestamps();
+    if ( do_linger0 )
+	{
+	lg.l_onoff = 1;
+	lg.l_linger = 0;
+	(void) setsockopt(
+	    conn_fd, SOL_SOCKET, SO_LINGER, (void*) &lg, sizeof(lg) );
+	}
+    }
+
+
+static void
+enable_timestamps( int fd )
+    {
+#ifdef HAVE_SO_TIMESTAMPING
+    int flags;
+
+    flags =
+	SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_RX_SOFTWARE |
+	SOF_TIMESTAMPING_SOFTWARE |
+	SOF_TIMESTAMPING_TX_HARDWARE | SOF_TIMESTAMPING_RX_HARDWARE |
+	SOF_TIMESTAMPING_RAW_HARDWARE | SOF_TIMESTAMPING_OPT_TSONLY;
+    if ( setsockopt(
+	     fd, SOL_SOCKET, SO_TIMESTAMPING, (void*) &flags,
+	     sizeof(flags) ) < 0 )
+	perror( "SO_TIMESTAMPING" );
+#endif /* HAVE_SO_TIMESTAMPING */
+    }
+
+
+#ifdef HAVE_SO_TIMESTAMPING
+/* Pulls the SCM_TIMESTAMPING stamps out of a message.  Slot 0 is the
+** software stamp, slot 2 the raw hardware one; either may be zero.
+*/
+static int
+find_timestamps( struct msghdr* msg, struct timespec* sw, struct timespec* hw )
+    {
+    struct cmsghdr* cm;
+    struct timespec* ts;
+
+    for ( cm = CMSG_FIRSTHDR( msg ); cm != (struct cmsghdr*) 0;
+	  cm = CMSG_NXTHDR( msg, cm ) )
+	if ( cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPING )
+	    {
+	    ts = (struct timespec*) CMSG_DATA( cm );
+	    *sw = ts[0];
+	    *hw = ts[2];
+	    return 1;
+	    }
+    return 0;
+    }
+#endif /* HAVE_SO_TIMESTAMPING */
+
+
+static void
+read_rx_timestamp( struct msghdr* msg )
+    {
+#ifdef HAVE_SO_TIMESTAMPING
+    if ( ! find_timestamps( msg, &rx_ts, &rx_hw ) )
+	return;
+    got_rx_ts = rx_ts.tv_sec != 0;
+    got_rx_hw = rx_hw.tv_sec != 0;
+#endif /* HAVE_SO_TIMESTAMPING */
+    }
+
+
+/* Drains the error queue.  The last transmit stamp is the one for the
+** request, since everything before it was connection setup.
+*/
+static void
+read_tx_timestamps( void )
+    {
+#ifdef HAVE_SO_TIMESTAMPING
+    struct msghdr msg;
+    char control[512];
+    struct timespec sw, hw;
+
+    for (;;)
+	{
+	(void) memset( (void*) &msg, 0, sizeof(msg) );
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	if ( recvmsg( conn_fd, &msg, MSG_ERRQUEUE|MSG_DONTWAIT ) < 0 )
+	    break;
+	if ( ! find_timestamps( &msg, &sw, &hw ) )
+	    continue;
+	if ( sw.tv_sec != 0 )
+	    {
+	    tx_ts = sw;
+	    got_tx_ts = 1;
+	    }
+	if ( hw.tv_sec != 0 )
+	    {
+	    tx_hw = hw;
+	    got_tx_hw = 1;
+	    }
+	}
+#endif /* HAVE_SO_TIMESTAMPING */
+    }
+
+
+/* Request out to first response segment in, in ms, using the hardware
+** stamps when both ends have one.
+*/
+static double
+wire_latency( void )
+    {
+    struct timespec* tx = &tx_ts;
+    struct timespec* rx = &rx_ts;
+
+    if ( got_tx_hw && got_rx_hw )
+	{
+	tx = &tx_hw;
+	rx = &rx_hw;
+	}
+    return ( rx->tv_sec - tx->tv_sec ) * 1000.0 +
+	( rx->tv_nsec - tx->tv_nsec ) / 1000000.0;
+    }
+
+
+/* Clears the per-probe -throughput state before each probe, so one that
+** gets no body can't report or record the last one's.
+*/
+static void
+tp_reset( void )
+    {
+    tp_started = 0;
+    tp_slot_bytes = 0;
+    tp_slots = tp_stalls = 0;
+    tp_min_rate = 0.0;
+    (void) memset( (void*) &tp_probe_hist, 0, sizeof(tp_probe_hist) );
+    }
+
+
+/* Counts n data bytes that just arrived into the -throughput slots. */
+static void
+tp_account( int n )
+    {
+    struct timeval now;
+    long long rate;
+
+    (void) gettimeofday( &now, (struct timezone*) 0 );
+    if ( ! tp_started )
+	{
+	tp_started = 1;
+	tp_slot_start = now;
+	}
+    while ( delta_timeval( &tp_slot_start, &now ) >= tp_period * 1000LL )
+	{
+	/* bytes per msec is KB/s */
+	rate = tp_slot_bytes / tp_period;
+	hist_record( &tp_probe_hist, rate );
+	if ( tp_slots == 0 || rate < tp_min_rate )
+	    tp_min_rate = rate;
+	if ( tp_slot_bytes == 0 )
+	    ++tp_stalls;
+	++tp_slots;
+	tp_slot_bytes = 0;
+	tp_slot_start.tv_usec += tp_period * 1000L;
+	tp_slot_start.tv_sec += tp_slot_start.tv_usec / 1000000L;
+	tp_slot_start.tv_usec %= 1000000L;
+	}
+    if ( bytes - n < TP_FIRST_MB && bytes >= TP_FIRST_MB )
+	tp_first_mb_at = now;
+    tp_slot_bytes += n;
+    }
+
+
+/* Adds a finished probe's -throughput numbers to s.  The trailing
+** partial slot is left out so it can't drag the rates down.
+*/
+static void
+tp_record( probe_stats* s, long long data_usecs )
+    {
+    int i;
+
+    if ( data_usecs <= 0 )
+	return;
+    accum_add( &s->tp_mean, (double) bytes / data_usecs );
+    if ( bytes >= TP_FIRST_MB )
+	accum_add(
+	    &s->tp_first_mb, delta_timeval( &started_at, &tp_first_mb_at ) / 1000.0 );
+    for ( i = 0; i < HIST_BUCKETS; ++i )
+	s->tp_hist.counts[i] += tp_probe_hist.counts[i];
+    s->tp_stalls += tp_stalls;
+    s->tp_stall_ms += (double) tp_stalls * tp_period;
+    }
+
+
+/* Sleeps until reading n more bytes keeps us at the -slowread rate,
+** measured from the first byte of the response.
+*/
+static void
+slow_pace( int n )
+    {
+    struct timeval now;
+    long long due, spent;
+
+    slow_total += n;
+    (void) gettimeofday( &now, (struct timezone*) 0 );
+    due = (long long) slow_total * 1000000LL / slow_rate;
+    spent = delta_timeval( &response_at, &now );
+    if ( due > spent )
+	sleep_secs( ( due - spent ) / 1000000.0 );
+    }
+
+
+/* Parses a -gate threshold:
+**   phase:pNN<ms      e.g. total:p99<250, connect:p50<20
+**   errors<pct        failed, timed out or invalid, as % of started
+**   throughput>MB/s   body bytes over data-phase time
+**   rps>n             completed probes per second
+*/
+static void
+parse_gate( char* spec )
+    {
+    gate* g;
+    char* colon;
+    int ph, n;
+
+    if ( num_gates >= MAX_GATES )
+	{
+	(void) fprintf( stderr, "%s: too many gates\n", argv0 );
+	exit( 1 );
+	}
+    g = &gates[num_gates];
+    (void) memset( (void*) g, 0, sizeof(*g) );
+    g->spec = spec;
+    if ( sscanf( spec, "errors<%lf", &g->limit ) == 1 )
+	g->kind = GK_ERRORS;
+    else if ( sscanf( spec, "throughput>%lf", &g->limit ) == 1 )
+	g->kind = GK_THROUGHPUT;
+    else if ( sscanf( spec, "rps>%lf", &g->limit ) == 1 )
+	g->kind = GK_RPS;
+    else
+	{
+	g->kind = GK_PCT;
+	g->phase = -1;
+	colon = strchr( spec, ':' );
+	if ( colon != (char*) 0 )
+	    for ( ph = 0; ph < NUM_PHASES; ++ph )
+		{
+		n = strcspn( phase_names[ph], " " );
+		if ( colon - spec == n && strncmp( spec, phase_names[ph], n ) == 0 )
+		    g->phase = ph;
+		}
+	if ( g->phase < 0 ||
+	     sscanf( colon + 1, "p%lf<%lf", &g->pct, &g->limit ) != 2 ||
+	     g->pct <= 0.0 || g->pct > 100.0 )
+	    {
+	    (void) fprintf( stderr, "%s: bad gate - %s\n", argv0, spec );
+	    exit( 1 );
+	    }
+	}
+    ++num_gates;
+    }
+
+
+/* Checks the -gate-window windows that have ended, before the next
+** probe starts.  Windows with no probes aren't judged.
+*/
+static void
+gate_tick( void )
+    {
+    struct timeval now;
+
+    if ( gate_window <= 0.0 )
+	return;
+    (void) gettimeofday( &now, (struct timezone*) 0 );
+    if ( ! gate_started )
+	{
+	gate_started = 1;
+	gate_win_start = now;
+	gate_snap = *st;
+	return;
+	}
+    while ( delta_timeval( &gate_win_start, &now ) >= gate_window * 1000000.0 )
+	{
+	gate_close_window( gate_window );
+	gate_win_start.tv_usec += (long) ( gate_window * 1000000.0 ) % 1000000L;
+	gate_win_start.tv_sec += (time_t) gate_window + gate_win_start.tv_usec / 1000000L;
+	gate_win_start.tv_usec %= 1000000L;
+	}
+    }
+
+
+/* Judges the window from the last snapshot to now, which covers secs
+** seconds.
+*/
+static void
+gate_close_window( double secs )
+    {
+    double value;
+    int i;
+
+    stats_delta( &gate_win, st, &gate_snap );
+    gate_snap = *st;
+    for ( i = 0; i < num_gates && gate_win.started > 0; ++i )
+	{
+	/* A rate over the short last window says little. */
+	if ( gates[i].kind == GK_RPS && secs < gate_window )
+	    continue;
+	if ( gate_check( &gates[i], &gate_win, secs, &value ) )
+	    {
+	    (void) fprintf(
+		stderr, "%s: gate %s failed in the window at %g s - %g\n",
+		argv0, gates[i].spec, gate_windows * gate_window, value );
+	    if ( gates[i].windows_failed++ == 0 ||
+		 ( gates[i].kind == GK_THROUGHPUT || gates[i].kind == GK_RPS ?
+		   value < gates[i].worst : value > gates[i].worst ) )
+		{
+		gates[i].worst = value;
+		gates[i].worst_at = gate_windows * gate_window;
+		}
+	    }
+	}
+    ++gate_windows;
+    }
+
+
+/* Works out a gate's value over s, which covers secs seconds, and
+** returns whether it fails.  A percentile with nothing completed is
+** left to the error gates, except over the whole run.
+*/
+static int
+gate_check( gate* g, probe_stats* s, double secs, double* valueP )
+    {
+    switch ( g->kind )
+	{
+	case GK_PCT:
+	if ( s->completed == 0 )
+	    {
+	    *valueP = 0.0;
+	    return secs == 0.0;
+	    }
+	*valueP = hist_percentile( &s->hist[g->phase], g->pct ) / 1000.0;
+	return *valueP > g->limit;
+
+	case GK_ERRORS:
+	*valueP = s->started > 0 ?
+	    ( s->failures + s->timeouts + s->invalid ) * 100.0 / s->started : 0.0;
+	return *valueP > g->limit;
+
+	case GK_THROUGHPUT:
+	*valueP = s->sum[PH_DATA] > 0.0 ?
+	    s->bytes / s->sum[PH_DATA] / 1000.0 : 0.0;
+	return *valueP < g->limit;
+
+	case GK_RPS:
+	*valueP = secs > 0.0 ? s->completed / secs : 0.0;
+	return *valueP < g->limit;
+	}
+    return 0;
+    }
+
+
+/* Judges the whole run, prints a line per gate and the verdict, and
+** returns the exit status: 2 for latency, 3 for errors, 4 for
+** throughput, from the first gate that failed.
+*/
+static int
+gate_report( void )
+    {
+    static int codes[] = { 2, 3, 4, 4 };
+    struct timeval now;
+    double secs;
+    int i, status;
+
+    if ( num_gates == 0 )
+	return 0;
+    /* The last window, however short, is judged too. */
+    if ( gate_window > 0.0 && gate_started )
+	{
+	gate_tick();
+	(void) gettimeofday( &now, (struct timezone*) 0 );
+	gate_close_window( delta_timeval( &gate_win_start, &now ) / 1000000.0 );
+	}
+    (void) gettimeofday( &now, (struct timezone*) 0 );
+    secs = delta_timeval( &run_start, &now ) / 1000000.0;
+    status = 0;
+    for ( i = 0; i < num_gates; ++i )
+	{
+	gates[i].failed = gate_check( &gates[i], st, 0.0, &gates[i].value );
+	if ( gates[i].kind == GK_RPS )
+	    gates[i].failed = gate_check( &gates[i], st, secs, &gates[i].value );
+	if ( gates[i].windows_failed > 0 )
+	    gates[i].failed = 1;
+	(void) printf(
+	    "gate %s %s", gates[i].failed ? "fail" : "pass", gates[i].spec );
+	if ( gates[i].kind == GK_PCT && st->completed == 0 )
+	    (void) printf( " value=none" );
+	else
+	    (void) printf( " value=%g", gates[i].value );
+	if ( gates[i].windows_failed > 0 )
+	    (void) printf(
+		" windows_failed=%d worst=%g worst_at=%g",
+		gates[i].windows_failed, gates[i].worst, gates[i].worst_at );
+	(void) printf( "\n" );
+	if ( gates[i].failed && status == 0 )
+	    status = codes[gates[i].kind];
+	}
+    (void) printf( "verdict %s exit=%d\n", status == 0 ? "pass" : "fail", status );
+    return status;
+    }
+
+
+/* d = now - then, for the counts, sums and histograms; minimums and
+** maximums can't be taken apart that way and are left out.
+*/
+static void
+stats_delta( probe_stats* d, probe_stats* now, probe_stats* then )
+    {
+    int ph, i;
+
+    clear_stats( d );
+    d->started = now->started - then->started;
+    d->completed = now->completed - then->completed;
+    d->failures = now->failures - then->failures;
+    d->timeouts = now->timeouts - then->timeouts;
+    d->invalid = now->invalid - then->invalid;
+    d->bytes = now->bytes - then->bytes;
+    for ( ph = 0; ph < NUM_PHASES; ++ph )
+	{
+	d->sum[ph] = now->sum[ph] - then->sum[ph];
+	for ( i = 0; i < HIST_BUCKETS; ++i )
+	    d->hist[ph].counts[i] = now->hist[ph].counts[i] - then->hist[ph].counts[i];
+	}
+    }
+
+
+/* Parses -rolling, a list of window lengths in seconds. */
+static void
+parse_rolling( char* spec )
+    {
+    char* cp;
+    int secs;
+
+    for ( cp = spec; *cp != '\0'; )
+	{
+	secs = atoi( cp );
+	if ( secs < 1 || secs > ROLL_SLOTS )
+	    {
+	    (void) fprintf(
+		stderr, "%s: rolling windows must be between 1 and %d seconds\n",
+		argv0, ROLL_SLOTS );
+	    exit( 1 );
+	    }
+	if ( num_roll_windows >= MAX_ROLL_WINDOWS )
+	    {
+	    (void) fprintf( stderr, "%s: too many rolling windows\n", argv0 );
+	    exit( 1 );
+	    }
+	roll_windows[num_roll_windows++] = secs;
+	cp += strspn( cp, "0123456789" );
+	if ( *cp == ',' )
+	    ++cp;
+	else if ( *cp != '\0' )
+	    usage();
+	}
+    }
+
+
+/* Closes the one-second slots that have ended and prints the summary
+** of each -rolling window that ends with them.
+*/
+static void
+roll_tick( void )
+    {
+    struct timeval now;
+    int i;
+
+    (void) gettimeofday( &now, (struct timezone*) 0 );
+    if ( ! roll_started )
+	{
+	roll_started = 1;
+	roll_slot_start = now;
+	roll_snap = *st;
+	return;
+	}
+    while ( delta_timeval( &roll_slot_start, &now ) >= 1000000LL )
+	{
+	roll_close_slot();
+	++roll_slot_start.tv_sec;
+	for ( i = 0; i < num_roll_windows; ++i )
+	    if ( roll_slots_done % roll_windows[i] == 0 )
+		roll_report( roll_windows[i], 1.0 );
+	}
+    }
+
+
+/* Moves what finished since the last snapshot into the next slot. */
+static void
+roll_close_slot( void )
+    {
+    roll_slot* sl;
+    int ph;
+
+    stats_delta( &roll_delta, st, &roll_snap );
+    roll_snap = *st;
+    sl = &roll_ring[roll_slots_done % ROLL_SLOTS];
+    sl->started = roll_delta.started;
+    sl->completed = roll_delta.completed;
+    sl->errors =
+	roll_delta.failures + roll_delta.timeouts + roll_delta.invalid;
+    sl->bytes = roll_delta.bytes;
+    for ( ph = 0; ph < NUM_PHASES; ++ph )
+	sl->hist[ph] = roll_delta.hist[ph];
+    ++roll_slots_done;
+    }
+
+
+/* At the end of the run, closes the last slot however short it is and
+** prints every window ending with it, before the summary.
+*/
+static void
+roll_finish( void )
+    {
+    struct timeval now;
+    long long part;
+    int i;
+
+    if ( num_roll_windows == 0 || ! roll_started )
+	return;
+    roll_tick();
+    (void) gettimeofday( &now, (struct timezone*) 0 );
+    part = delta_timeval( &roll_slot_start, &now );
+    if ( part >= 1000LL )
+	{
+	roll_close_slot();
+	for ( i = 0; i < num_roll_windows; ++i )
+	    roll_report( roll_windows[i], part / 1000000.0 );
+	}
+    else
+	/* Ended right on a boundary; only the windows not just shown. */
+	for ( i = 0; i < num_roll_windows; ++i )
+	    if ( roll_slots_done > 0 && roll_slots_done % roll_windows[i] != 0 )
+		roll_report( roll_windows[i], 1.0 );
+    }
+
+
+/* How long until the current slot ends. */
+static long long
+roll_next_usecs( void )
+    {
+    struct timeval now;
+    long long left;
+
+    if ( ! roll_started )
+	return 1000000LL;
+    (void) gettimeofday( &now, (struct timezone*) 0 );
+    left = 1000000LL - delta_timeval( &roll_slot_start, &now );
+    return max( left, 1000LL );
+    }
+
+
+/* One line for the window of the last secs slots, the newest of which
+** covers only the fraction last of its second at the end of the run.
+*/
+static void
+roll_report( int secs, double last )
+    {
+    roll_slot* sl;
+    int n, k, ph, i, finished;
+
+    n = min( secs, roll_slots_done );
+    (void) memset( (void*) &roll_sum, 0, sizeof(roll_sum) );
+    for ( k = 1; k <= n; ++k )
+	{
+	sl = &roll_ring[( roll_slots_done - k ) % ROLL_SLOTS];
+	roll_sum.started += sl->started;
+	roll_sum.completed += sl->completed;
+	roll_sum.errors += sl->errors;
+	roll_sum.bytes += sl->bytes;
+	for ( ph = 0; ph < NUM_PHASES; ++ph )
+	    for ( i = 0; i < HIST_BUCKETS; ++i )
+		roll_sum.hist[ph].counts[i] += sl->hist[ph].counts[i];
+	}
+    finished = roll_sum.completed + roll_sum.errors;
+    (void) printf(
+	"rolling %ds at %gs: %d started, %g/s, %g%% errors", secs,
+	roll_slots_done - 1 + last, roll_sum.started,
+	roll_sum.started / ( n - 1 + last ),
+	finished > 0 ? 100.0 * roll_sum.errors / finished : 0.0 );
+    if ( roll_sum.completed > 0 )
+	{
+	(void) printf( ", p50/p99" );
+	for ( ph = 0; ph < NUM_PHASES; ++ph )
+	    (void) printf(
+		" %.*s %g/%g",
+		(int) strcspn( phase_names[ph], " " ), phase_names[ph],
+		hist_percentile( &roll_sum.hist[ph], 50.0 ) / 1000.0,
+		hist_percentile( &roll_sum.hist[ph], 99.0 ) / 1000.0 );
+	(void) printf( " ms" );
+	}
+    (void) printf( "\n" );
+    (void) fflush( stdout );
+    }
+
+
+/* Sleeps between probes, waking at each -rolling boundary on the way. */
+static void
+idle_secs( double secs )
+    {
+    double piece;
+
+    if ( num_roll_windows == 0 )
+	{
+	sleep_secs( secs );
+	return;
+	}
+    while ( secs > 0.0 && ! terminate )
+	{
+	piece = min( secs, roll_next_usecs() / 1000000.0 );
+	sleep_secs( piece );
+	roll_tick();
+	secs -= piece;
+	}
+    }
+
+
+/* One round of -ab: a probe to each side, in random order.  The main
+** loop has counted the first probe against -count; the second is
+** counted here, so an odd -count ends on half a round.
+*/
+static void
+ab_round( void )
+    {
+    int first, i, ok;
+
+    first = random() % 2;
+    for ( i = 0; i < 2; ++i )
+	{
+	if ( i > 0 )
+	    {
+	    if ( count == 0 || terminate )
+		break;
+	    if ( count > 0 )
+		--count;
+	    }
+	ab_use( first ^ i );
+	probe_started();
+	timeout_start();
+	timeout_phase( TO_CONNECT );
+	ok = fetch_probe();
+	timeout_cancel();
+	if ( ok )
+	    probe_succeeded();
+	else
+	    probe_failed();
+	}
+    }
+
+
+static void
+ab_sample( double ms )
+    {
+    int s = ab_side;
+
+    if ( ab_nsamples[s] == ab_maxsamples[s] )
+	{
+	ab_maxsamples[s] = max( ab_maxsamples[s] * 2, 1000 );
+	ab_samples[s] = (double*) realloc(
+	    (void*) ab_samples[s], ab_maxsamples[s] * sizeof(double) );
+	if ( ab_samples[s] == (double*) 0 )
+	    {
+	    (void) fprintf( stderr, "%s: out of memory\n", argv0 );
+	    exit( 1 );
+	    }
+	}
+    ab_samples[s][ab_nsamples[s]++] = ms;
+    }
+
+
+/* Compares the two sides of -ab.  The differences in the percentiles of
+** the total time get bootstrap 95% confidence intervals, and the
+** Mann-Whitney U test says whether B's times are shifted from A's.
+*/
+static void
+ab_report( void )
+    {
+    static double pcts[3] = { 50.0, 90.0, 99.0 };
+    double* a = ab_samples[0];
+    double* b = ab_samples[1];
+    int na = ab_nsamples[0];
+    int nb = ab_nsamples[1];
+    double* ra;
+    double* rb;
+    double* diffs[3];
+    double* all;
+    char* from_b;
+    int nres, r, i, j, k, p;
+    double rank_b, ties, u, mean, var, z, pval;
+
+    (void) printf( "--- A/B: A %s, B %s\n", url, ab_arg );
+    report_group( &ab_stats[0], "A" );
+    report_group( &ab_stats[1], "B" );
+    if ( na < 2 || nb < 2 )
+	{
+	(void) printf( "too few completed probes to compare\n" );
+	return;
+	}
+    qsort( a, na, sizeof(double), double_cmp );
+    qsort( b, nb, sizeof(double), double_cmp );
+
+    /* Fewer resamples for big runs, so the report doesn't take minutes. */
+    nres = min( AB_RESAMPLES, max( 100, 20000000 / ( na + nb ) ) );
+    ra = (double*) malloc( na * sizeof(double) );
+    rb = (double*) malloc( nb * sizeof(double) );
+    all = (double*) malloc( ( na + nb ) * sizeof(double) );
+    from_b = (char*) malloc( na + nb );
+    for ( p = 0; p < 3; ++p )
+	diffs[p] = (double*) malloc( nres * sizeof(double) );
+    if ( ra == (double*) 0 || rb == (double*) 0 || all == (double*) 0 ||
+	 from_b == (char*) 0 || diffs[0] == (double*) 0 ||
+	 diffs[1] == (double*) 0 || diffs[2] == (double*) 0 )
+	{
+	(void) fprintf( stderr, "%s: out of memory\n", argv0 );
+	exit( 1 );
+	}
+    for ( r = 0; r < nres; ++r )
+	{
+	for ( i = 0; i < na; ++i )
+	    ra[i] = a[random() % na];
+	for ( i = 0; i < nb; ++i )
+	    rb[i] = b[random() % nb];
+	qsort( ra, na, sizeof(double), double_cmp );
+	qsort( rb, nb, sizeof(double), double_cmp );
+	for ( p = 0; p < 3; ++p )
+	    diffs[p][r] =
+		ab_quantile( rb, nb, pcts[p] ) - ab_quantile( ra, na, pcts[p] );
+	}
+    for ( p = 0; p < 3; ++p )
+	{
+	qsort( diffs[p], nres, sizeof(double), double_cmp );
+	(void) printf(
+	    "total p%g: A %g ms, B %g ms, B-A %+g ms (95%% CI %+g to %+g)\n",
+	    pcts[p], ab_quantile( a, na, pcts[p] ), ab_quantile( b, nb, pcts[p] ),
+	    ab_quantile( b, nb, pcts[p] ) - ab_quantile( a, na, pcts[p] ),
+	    ab_quantile( diffs[p], nres, 2.5 ),
+	    ab_quantile( diffs[p], nres, 97.5 ) );
+	}
+
+    /* Mann-Whitney: merge the sorted samples, give tied runs their
+    ** average rank, and use the normal approximation with the tie
+    ** correction.
+    */
+    for ( i = j = k = 0; i < na || j < nb; ++k )
+	if ( j >= nb || ( i < na && a[i] <= b[j] ) )
+	    {
+	    all[k] = a[i++];
+	    from_b[k] = 0;
+	    }
+	else
+	    {
+	    all[k] = b[j++];
+	    from_b[k] = 1;
+	    }
+    rank_b = ties = 0.0;
+    for ( i = 0; i < na + nb; i = j )
+	{
+	for ( j = i + 1; j < na + nb && all[j] == all[i]; ++j )
+	    ;
+	for ( k = i; k < j; ++k )
+	    if ( from_b[k] )
+		rank_b += ( i + 1 + j ) / 2.0;
+	ties += (double) ( j - i ) * ( j - i ) * ( j - i ) - ( j - i );
+	}
+    u = rank_b - nb * ( nb + 1.0 ) / 2.0;
+    mean = (double) na * nb / 2.0;
+    var = (double) na * nb / 12.0 *
+	( ( na + nb + 1.0 ) - ties / ( (double) ( na + nb ) * ( na + nb - 1 ) ) );
+    z = var > 0.0 ? ( u - mean ) / sqrt( var ) : 0.0;
+    pval = erfc( fabs( z ) / sqrt( 2.0 ) );
+    (void) printf( "Mann-Whitney U = %g, z = %g, p = %g: ", u, z, pval );
+    if ( pval >= 0.05 )
+	(void) printf( "no significant difference\n" );
+    else if ( z > 0.0 )
+	(void) printf( "B is slower than A\n" );
+    else
+	(void) printf( "B is faster than A\n" );
+
+    free( (void*) ra );
+    free( (void*) rb );
+    free( (void*) all );
+    free( (void*) from_b );
+    for ( p = 0; p < 3; ++p )
+	free( (void*) diffs[p] );
+    }
+
+
+/* The pct percentile of n sorted values, by nearest rank. */
+static double
+ab_quantile( double* v, int n, double pct )
+    {
+    int i = (int) ceil( pct / 100.0 * n ) - 1;
+
+    return v[max( 0, min( i, n - 1 ) )];
+    }
+
+
+/* One round of -slowconns: that many slow readers at once, each in its
+** own child so they really overlap.
+*/
+static void
+slow_round( void )
+    {
+    pid_t pids[MAX_CHILDREN];
+    int fds[MAX_CHILDREN];
+    int i;
+
+    for ( i = 0; i < slow_conns; ++i )
+	{
+	probe_started();
+	fds[i] = spawn_probe( &pids[i] );
+	}
+    for ( i = 0; i < slow_conns; ++i )
+	if ( fds[i] < 0 )
+	    {
+	    resp_backend = (probe_stats*) 0;
+	    probe_failed();
+	    }
+	else
+	    reap_probe( fds[i], pids[i] );
+    }
+
+
+/* Forks a child to run one probe.  Children leave the shared stats alone
+** and send a child_result back over a pipe, including which phase timed
+** out.  Returns the read end of the pipe, or -1.
+*/
+static int
+spawn_probe( pid_t* pidP )
+    {
+    int p[2];
+    child_result r;
+
+    if ( pipe( p ) < 0 )
+	{
+	perror( "pipe" );
+	return -1;
+	}
+    (void) fflush( stdout );
+    *pidP = fork();
+    if ( *pidP < 0 )
+	{
+	perror( "fork" );
+	(void) close( p[0] );
+	(void) close( p[1] );
+	return -1;
+	}
+    if ( *pidP == 0 )
+	{
+	(void) close( p[0] );
+	/* Each child needs its own random templates. */
+	srandom( (int) random() ^ getpid() );
+	shm = &local_shm;
+	st = &local_shm.s;
+	clear_stats( st );
+	group_stats = (probe_stats*) 0;
+	(void) memset( (void*) &r, 0, sizeof(r) );
+	r.timed_out = -1;
+	if ( sigsetjmp( jb, 1 ) != 0 )
+	    {
+	    r.timed_out = to_phase;
+	    (void) snprintf( r.backend, sizeof(r.backend), "%s", resp_backend_name );
+	    r.backend_other = resp_backend == &backends.other;
+	    (void) write( p[1], (void*) &r, sizeof(r) );
+	    _exit( 0 );
+	    }
+	timeout_start();
+	timeout_phase( TO_CONNECT );
+	r.ok = fetch_probe();
+	timeout_cancel();
+	r.bytes = bytes;
+	r.port_failures = st->port_failures;
+	r.started_at = started_at;
+	r.connect_at = connect_at;
+	r.response_at = response_at;
+	r.finished_at = finished_at;
+	r.tcp_at = tcp_at;
+	r.tunnel_at = tunnel_at;
+	r.tunnelled = tunnelled;
+	r.status = resp_status;
+	r.cache_class = cache_class;
+	r.age = resp_age;
+	(void) strcpy( r.etag, resp_etag );
+	(void) strcpy( r.last_modified, resp_last_modified );
+	(void) snprintf( r.backend, sizeof(r.backend), "%s", resp_backend_name );
+	r.backend_other = resp_backend == &backends.other;
+	r.body_found = body_found;
+	r.body_hash = body_hash;
+	r.encoding = resp_encoding;
+	r.dec_started = dec_started;
+	r.dec_done = dec_done;
+	r.dec_failed = dec_failed;
+	r.dec_bytes = dec_bytes;
+	r.dec_usecs = dec_usecs;
+	r.hops = num_hops;
+	r.hop_overflow = hop_overflow;
+	r.reused = num_reused;
+	(void) memcpy( (void*) r.hop_status, (void*) hop_status, sizeof(hop_status) );
+	(void) memcpy( (void*) r.hop_usecs, (void*) hop_usecs, sizeof(hop_usecs) );
+	r.redirect_usecs = redirect_usecs;
+	(void) write( p[1], (void*) &r, sizeof(r) );
+	_exit( 0 );
+	}
+    (void) close( p[1] );
+    return p[0];
+    }
+
 
-		case ST_CON:
-		switch ( buf[bytes_handled] )
-		    {
-		    case 'T': case 't':
-		    conn_state = ST_CONT;
-		    break;
-		    case '\n':
-		    conn_state = ST_LF;
-		    break;
-		    case '\r':
-		    conn_state = ST_CR;
-		    break;
-		    default:
-		    conn_state = ST_TEXT;
-		    break;
-		    }
-		break;
+/* Collects a child's result and records the probe.  A child that died
+** without reporting counts as a failure.
+*/
+static void
+reap_probe( int fd, pid_t pid )
+    {
+    child_result r;
+    int n, status;
 
-		case ST_CONT:
-		switch ( buf[bytes_handled] )
-		    {
-		    case 'E': case 'e':
-		    conn_state = ST_CONTE;
-		    break;
-		    case '\n':
-		    conn_state = ST_LF;
-		    break;
-		    case '\r':
-		    conn_state = ST_CR;
-		    break;
-		    default:
-		    conn_state = ST_TEXT;
-		    break;
-		    }
-		break;
+    n = read( fd, (void*) &r, sizeof(r) );
+    (void) close( fd );
+    (void) waitpid( pid, &status, 0 );
+    resp_backend = (probe_stats*) 0;
+    if ( n != sizeof(r) )
+	{
+	probe_failed();
+	return;
+	}
+    /* A child whose table was full only knows it was one of the others. */
+    if ( r.backend_other )
+	resp_backend = &backends.other;
+    else if ( r.backend[0] != '\0' )
+	resp_backend = key_lookup(
+	    &backends, r.backend, strlen( r.backend ), (char**) 0 );
+    if ( r.port_failures > 0 )
+	{
+	stats_begin();
+	st->port_failures += r.port_failures;
+	stats_end();
+	}
+    if ( r.ok )
+	{
+	bytes = r.bytes;
+	started_at = r.started_at;
+	connect_at = r.connect_at;
+	response_at = r.response_at;
+	finished_at = r.finished_at;
+	tcp_at = r.tcp_at;
+	tunnel_at = r.tunnel_at;
+	tunnelled = r.tunnelled;
+	resp_status = r.status;
+	cache_class = r.cache_class;
+	resp_age = r.age;
+	(void) strcpy( resp_etag, r.etag );
+	(void) strcpy( resp_last_modified, r.last_modified );
+	body_found = r.body_found;
+	body_hash = r.body_hash;
+	resp_encoding = r.encoding;
+	dec_started = r.dec_started;
+	dec_done = r.dec_done;
+	dec_failed = r.dec_failed;
+	dec_bytes = r.dec_bytes;
+	dec_usecs = r.dec_usecs;
+	num_hops = r.hops;
+	hop_overflow = r.hop_overflow;
+	num_reused = r.reused;
+	conn_reused = 0;
+	(void) memcpy( (void*) hop_status, (void*) r.hop_status, sizeof(hop_status) );
+	(void) memcpy( (void*) hop_usecs, (void*) r.hop_usecs, sizeof(hop_usecs) );
+	redirect_usecs = r.redirect_usecs;
+	got_tcp_info = tfo_accepted = 0;
+	got_tx_ts = got_rx_ts = 0;
+	tp_reset();
+	probe_succeeded();
+	}
+    else if ( r.timed_out >= 0 )
+	probe_timed_out( r.timed_out );
+    else
+	probe_failed();
+    }
 
-		case ST_CONTE:
-		switch ( buf[bytes_handled] )
-		    {
-		    case 'N': case 'n':
-		    conn_state = ST_CONTEN;
-		    break;
-		    case '\n':
-		    conn_state = ST_LF;
-		    break;
-		    case '\r':
-		    conn_state = ST_CR;
-		    break;
-		    default:
-		    conn_state = ST_TEXT;
-		    break;
-		    }
-		break;
 
-		case ST_CONTEN:
-		switch ( buf[bytes_handled] )
-		    {
-		    case 'T': case 't':
-		    conn_state = ST_CONTENT;
-		    break;
-		    case '\n':
-		    conn_state = ST_LF;
-		    break;
-		    case '\r':
-		    conn_state = ST_CR;
-		    break;
-		    default:
-		    conn_state = ST_TEXT;
-		    break;
-		    }
-		break;
+/* Sends probes open loop, following sg's rate from start on: each one
+** runs in a child so a slow response doesn't hold up the next send.
+** Probes still running at the end carry on into whatever comes next,
+** and are counted in the group they were sent in.
+*/
+static void
+open_loop( segment* sg, struct timeval* start )
+    {
+    struct timeval now;
+    double due;
+    long long spent;
+    long sent;
 
-		case ST_CONTENT:
-		switch ( buf[bytes_handled] )
-		    {
-		    case '-':
-		    conn_state = ST_CONTENT_;
-		    break;
-		    case '\n':
-		    conn_state = ST_LF;
-		    break;
-		    case '\r':
-		    conn_state = ST_CR;
-		    break;
-		    default:
-		    conn_state = ST_TEXT;
-		    break;
-		    }
-		break;
+    due = 0.0;
+    for ( sent = 0; ! terminate; )
+	{
+	due = seg_time( sg, (double) sent, due );
+	if ( due < 0.0 )
+	    break;
+	(void) gettimeofday( &now, (struct timezone*) 0 );
+	spent = delta_timeval( start, &now );
+	if ( spent < due * 1000000.0 )
+	    {
+	    wait_kids( (long long) ( due * 1000000.0 ) - spent );
+	    continue;
+	    }
+	++sent;
+	send_probe();
+	}
+    /* The segment lasts its full time even when nothing more is due in
+    ** it, as with a zero rate or the tail of a slow one.
+    */
+    while ( ! terminate )
+	{
+	(void) gettimeofday( &now, (struct timezone*) 0 );
+	spent = delta_timeval( start, &now );
+	if ( spent >= sg->secs * 1000000.0 )
+	    break;
+	wait_kids( (long long) ( sg->secs * 1000000.0 ) - spent );
+	}
+    }
+
+
+/* Starts one open-loop probe in a child, counted in group_stats. */
+static void
+send_probe( void )
+    {
+    int fd;
+    pid_t pid;
+
+    probe_started();
+    if ( num_kids >= MAX_CHILDREN )
+	{
+	++kid_overflows;
+	resp_backend = (probe_stats*) 0;
+	probe_failed();
+	return;
+	}
+    fd = spawn_probe( &pid );
+    if ( fd < 0 )
+	{
+	resp_backend = (probe_stats*) 0;
+	probe_failed();
+	return;
+	}
+    kid_fds[num_kids] = fd;
+    kid_pids[num_kids] = pid;
+    kid_groups[num_kids] = group_stats;
+    ++num_kids;
+    }
+
+
+/* Waits up to usecs, or indefinitely if negative, for child probes to
+** finish, and records the ones that do.  poll() only does msecs, so the
+** last fraction of a msec before a send is spun away.
+*/
+static void
+wait_kids( long long usecs )
+    {
+    struct pollfd pfds[MAX_CHILDREN];
+    probe_stats* group;
+    int i;
+
+    if ( num_kids == 0 )
+	{
+	if ( usecs > 0 )
+	    idle_secs( usecs / 1000000.0 );
+	return;
+	}
+    /* Come back at the next -rolling boundary even if nothing finishes. */
+    if ( num_roll_windows > 0 )
+	{
+	roll_tick();
+	if ( usecs < 0 || usecs > roll_next_usecs() )
+	    usecs = roll_next_usecs();
+	}
+    for ( i = 0; i < num_kids; ++i )
+	{
+	pfds[i].fd = kid_fds[i];
+	pfds[i].events = POLLIN;
+	pfds[i].revents = 0;
+	}
+    if ( poll( pfds, num_kids, usecs < 0 ? -1 : (int) ( usecs / 1000 ) ) <= 0 )
+	return;
+    /* Going backwards, the entry moved into a reaped slot is done with. */
+    group = group_stats;
+    for ( i = num_kids - 1; i >= 0; --i )
+	if ( pfds[i].revents != 0 )
+	    {
+	    group_stats = kid_groups[i];
+	    reap_probe( kid_fds[i], kid_pids[i] );
+	    --num_kids;
+	    kid_fds[i] = kid_fds[num_kids];
+	    kid_pids[i] = kid_pids[num_kids];
+	    kid_groups[i] = kid_groups[num_kids];
+	    }
+    group_stats = group;
+    }
+
+
+static void
+drain_kids( void )
+    {
+    while ( num_kids > 0 )
+	wait_kids( -1 );
+    }
+
+
+/* How many probes sg should have sent t secs in: its rate integrated. */
+static double
+seg_sends( segment* sg, double t )
+    {
+    double n, cycles, part;
+
+    switch ( sg->shape )
+	{
+	case SH_RAMP:
+	return sg->a * t + ( sg->b - sg->a ) * t * t / ( 2.0 * sg->secs );
+	case SH_SINE:
+	return sg->a * t +
+	    sg->b * sg->c / ( 2.0 * M_PI ) *
+	    ( 1.0 - cos( 2.0 * M_PI * t / sg->c ) );
+	case SH_BURST:
+	cycles = floor( t / sg->d );
+	part = t - cycles * sg->d;
+	n = sg->a * t + ( sg->b - sg->a ) * cycles * sg->c;
+	return n + ( sg->b - sg->a ) * min( part, sg->c );
+	default:
+	return sg->a * t;
+	}
+    }
+
+
+/* Returns when, in secs into sg, the n'th probe is due, or -1 if that's
+** past its end.  The answer is at least from, the previous one.
+*/
+static double
+seg_time( segment* sg, double n, double from )
+    {
+    double lo, hi, mid;
+    int i;
+
+    if ( seg_sends( sg, sg->secs ) <= n )
+	return -1.0;
+    if ( n <= 0.0 )
+	return 0.0;
+    /* seg_sends() never decreases, so bisect; 40 rounds is sub-usec. */
+    lo = from;
+    hi = sg->secs;
+    for ( i = 0; i < 40; ++i )
+	{
+	mid = ( lo + hi ) / 2.0;
+	if ( seg_sends( sg, mid ) >= n )
+	    hi = mid;
+	else
+	    lo = mid;
+	}
+    return hi;
+    }
+
+
+static void
+seg_describe( segment* sg, char* buf, int size )
+    {
+    switch ( sg->shape )
+	{
+	case SH_RAMP:
+	(void) snprintf(
+	    buf, size, "ramp %g to %g rps over %g s", sg->a, sg->b, sg->secs );
+	break;
+	case SH_SINE:
+	(void) snprintf(
+	    buf, size, "sine %g +/- %g rps, period %g s, for %g s", sg->a,
+	    sg->b, sg->c, sg->secs );
+	break;
+	case SH_BURST:
+	(void) snprintf(
+	    buf, size, "burst %g rps, %g rps for %g s every %g s, for %g s",
+	    sg->a, sg->b, sg->c, sg->d, sg->secs );
+	break;
+	default:
+	(void) snprintf( buf, size, "%g rps for %g s", sg->a, sg->secs );
+	break;
+	}
+    }
+
+
+/* Reads the -profile file: one segment per line, as
+**   shape secs rate-args...
+** with blank lines and # comments skipped.
+*/
+static void
+read_profile( void )
+    {
+    FILE* fp;
+    char line[1000];
+    char shape[100];
+    segment* sg;
+    int lineno, n, ok;
+
+    fp = fopen( profile_file, "r" );
+    if ( fp == (FILE*) 0 )
+	{
+	perror( profile_file );
+	exit( 1 );
+	}
+    num_segments = 0;
+    lineno = 0;
+    while ( fgets( line, sizeof(line), fp ) != (char*) 0 )
+	{
+	++lineno;
+	n = sscanf( line, "%99s", shape );
+	if ( n != 1 || shape[0] == '#' )
+	    continue;
+	if ( num_segments >= MAX_SEGMENTS )
+	    {
+	    (void) fprintf(
+		stderr, "%s: %s - more than %d segments\n", argv0,
+		profile_file, MAX_SEGMENTS );
+	    exit( 1 );
+	    }
+	sg = &segments[num_segments];
+	(void) memset( (void*) sg, 0, sizeof(*sg) );
+	n = sscanf(
+	    line, "%99s %lf %lf %lf %lf %lf", shape, &sg->secs, &sg->a, &sg->b,
+	    &sg->c, &sg->d );
+	if ( strcmp( shape, "const" ) == 0 )
+	    {
+	    sg->shape = SH_CONST;
+	    ok = n >= 3;
+	    }
+	else if ( strcmp( shape, "ramp" ) == 0 )
+	    {
+	    sg->shape = SH_RAMP;
+	    ok = n >= 4 && sg->b >= 0.0;
+	    }
+	else if ( strcmp( shape, "sine" ) == 0 )
+	    {
+	    sg->shape = SH_SINE;
+	    ok = n >= 5 && sg->b >= 0.0 && sg->b <= sg->a && sg->c > 0.0;
+	    }
+	else if ( strcmp( shape, "burst" ) == 0 )
+	    {
+	    sg->shape = SH_BURST;
+	    ok = n >= 6 && sg->b >= sg->a && sg->c > 0.0 && sg->d >= sg->c;
+	    }
+	else
+	    ok = 0;
+	if ( ! ok || sg->secs <= 0.0 || sg->a < 0.0 )
+	    {
+	    (void) fprintf(
+		stderr, "%s: %s line %d - bad segment\n", argv0, profile_file,
+		lineno );
+	    exit( 1 );
+	    }
+	clear_stats( &seg_stats[num_segments] );
+	++num_segments;
+	}
+    (void) fclose( fp );
+    if ( num_segments == 0 )
+	{
+	(void) fprintf( stderr, "%s: %s - no segments\n", argv0, profile_file );
+	exit( 1 );
+	}
+    }
+
+
+/* Runs the -profile segments back to back on one timeline, so a segment
+** starts on time even if the last one's probes are still out.
+*/
+static void
+run_profile( void )
+    {
+    struct timeval start;
+    long usecs;
+    int i;
+    char desc[200];
+
+    (void) gettimeofday( &start, (struct timezone*) 0 );
+    for ( i = 0; i < num_segments && ! terminate; ++i )
+	{
+	group_stats = &seg_stats[i];
+	open_loop( &segments[i], &start );
+	usecs = (long) ( segments[i].secs * 1000000.0 );
+	start.tv_sec += usecs / 1000000L;
+	start.tv_usec += usecs % 1000000L;
+	start.tv_sec += start.tv_usec / 1000000L;
+	start.tv_usec %= 1000000L;
+	seg_describe( &segments[i], desc, sizeof(desc) );
+	(void) printf(
+	    "profile: segment %d (%s) sent %d\n", i + 1, desc,
+	    seg_stats[i].started );
+	(void) fflush( stdout );
+	}
+    group_stats = (probe_stats*) 0;
+    drain_kids();
+    }
+
+
+/* Finds or adds the statistics for the first len chars of key.  Keys
+** are looked up in place, and only copied when they are added.  If keyP
+** is given it gets the table's copy of the key.
+*/
+static probe_stats*
+key_lookup( key_table* t, char* key, int len, char** keyP )
+    {
+    unsigned int h;
+    int i;
+    key_entry* e;
+
+    /* FNV-1a */
+    h = 2166136261U;
+    for ( i = 0; i < len; ++i )
+	h = ( h ^ (unsigned char) key[i] ) * 16777619U;
+    for ( i = h % ( MAX_KEYS * 2 ); ; i = ( i + 1 ) % ( MAX_KEYS * 2 ) )
+	{
+	e = &t->e[i];
+	if ( e->key == (char*) 0 )
+	    break;
+	if ( strncmp( e->key, key, len ) == 0 && e->key[len] == '\0' )
+	    {
+	    if ( keyP != (char**) 0 )
+		*keyP = e->key;
+	    return e->s;
+	    }
+	}
+    /* Half the slots stay empty, so probes stay short. */
+    if ( t->n >= MAX_KEYS )
+	{
+	if ( keyP != (char**) 0 )
+	    *keyP = "(other)";
+	return &t->other;
+	}
+    e->key = (char*) malloc( len + 1 );
+    e->s = (probe_stats*) malloc( sizeof(probe_stats) );
+    if ( e->key == (char*) 0 || e->s == (probe_stats*) 0 )
+	{
+	(void) fprintf( stderr, "%s: out of memory\n", argv0 );
+	exit( 1 );
+	}
+    (void) memcpy( (void*) e->key, (void*) key, len );
+    e->key[len] = '\0';
+    clear_stats( e->s );
+    ++t->n;
+    if ( keyP != (char**) 0 )
+	*keyP = e->key;
+    return e->s;
+    }
+
+
+static int
+key_cmp( const void* a, const void* b )
+    {
+    key_entry* ea = (key_entry*) a;
+    key_entry* eb = (key_entry*) b;
 
-		case ST_CONTENT_:
-		switch ( buf[bytes_handled] )
-		    {
-		    case 'L': case 'l':
-		    conn_state = ST_CONTENT_L;
-		    break;
-		    case '\n':
-		    conn_state = ST_LF;
-		    break;
-		    case '\r':
-		    conn_state = ST_CR;
-		    break;
-		    default:
-		    conn_state = ST_TEXT;
-		    break;
-		    }
-		break;
+    return eb->s->started - ea->s->started;
+    }
 
-		case ST_CONTENT_L:
-		switch ( buf[bytes_handled] )
-		    {
-		    case 'E': case 'e':
-		    conn_state = ST_CONTENT_LE;
-		    break;
-		    case '\n':
-		    conn_state = ST_LF;
-		    break;
-		    case '\r':
-		    conn_state = ST_CR;
-		    break;
-		    default:
-		    conn_state = ST_TEXT;
-		    break;
-		    }
-		break;
 
-		case ST_CONTENT_LE:
-		switch ( buf[bytes_handled] )
-		    {
-		    case 'N': case 'n':
-		    conn_state = ST_CONTENT_LEN;
-		    break;
-		    case '\n':
-		    conn_state = ST_LF;
-		    break;
-		    case '\r':
-		    conn_state = ST_CR;
-		    break;
-		    default:
-		    conn_state = ST_TEXT;
-		    break;
-		    }
-		break;
+/* One line per key, busiest first. */
+static void
+report_keys( key_table* t, char* title )
+    {
+    key_entry sorted[MAX_KEYS + 1];
+    int i, n;
+    probe_stats* s;
 
-		case ST_CONTENT_LEN:
-		switch ( buf[bytes_handled] )
-		    {
-		    case 'G': case 'g':
-		    conn_state = ST_CONTENT_LENG;
-		    break;
-		    case '\n':
-		    conn_state = ST_LF;
-		    break;
-		    case '\r':
-		    conn_state = ST_CR;
-		    break;
-		    default:
-		    conn_state = ST_TEXT;
-		    break;
-		    }
-		break;
+    for ( i = n = 0; i < MAX_KEYS * 2; ++i )
+	if ( t->e[i].key != (char*) 0 )
+	    sorted[n++] = t->e[i];
+    if ( t->other.started > 0 )
+	{
+	sorted[n].key = "(other)";
+	sorted[n].s = &t->other;
+	++n;
+	}
+    qsort( sorted, n, sizeof(sorted[0]), key_cmp );
+    (void) printf( "--- by %s:\n", title );
+    for ( i = 0; i < n; ++i )
+	{
+	s = sorted[i].s;
+	(void) printf(
+	    "%s: %d started, %d completed, %d failures, %d timeouts",
+	    sorted[i].key, s->started, s->completed, s->failures,
+	    s->timeouts );
+	if ( s->invalid > 0 )
+	    (void) printf( ", %d invalid", s->invalid );
+	if ( s->completed > 0 )
+	    (void) printf(
+		", total p50/p90/p99/max = %g/%g/%g/%g ms",
+		hist_percentile( &s->hist[PH_TOTAL], 50.0 ) / 1000.0,
+		hist_percentile( &s->hist[PH_TOTAL], 90.0 ) / 1000.0,
+		hist_percentile( &s->hist[PH_TOTAL], 99.0 ) / 1000.0,
+		s->max[PH_TOTAL] );
+	(void) printf( "\n" );
+	}
+    }
 
-		case ST_CONTENT_LENG:
-		switch ( buf[bytes_handled] )
-		    {
-		    case 'T': case 't':
-		    conn_state = ST_CONTENT_LENGT;
-		    break;
-		    case '\n':
-		    conn_state = ST_LF;
-		    break;
-		    case '\r':
-		    conn_state = ST_CR;
-		    break;
-		    default:
-		    conn_state = ST_TEXT;
-		    break;
-		    }
-		break;
 
-		case ST_CONTENT_LENGT:
-		switch ( buf[bytes_handled] )
-		    {
-		    case 'H': case 'h':
-		    conn_state = ST_CONTENT_LENGTH;
-		    break;
-		    case '\n':
-		    conn_state = ST_LF;
-		    break;
-		    case '\r':
-		    conn_state = ST_CR;
-		    break;
-		    default:
-		    conn_state = ST_TEXT;
-		    break;
-		    }
-		break;
+/* -replay: reads the trace a line at a time, each line
+**   timestamp method path [vhost [body-bytes]]
+** with the timestamp in seconds, and sends each request open loop at its
+** original offset from the first one, divided by -speed.  A vhost of "-"
+** keeps the usual one.  Per-path statistics ignore the query string.
+*/
+static void
+run_replay( void )
+    {
+    FILE* fp;
+    char line[3000];
+    struct timeval start, now;
+    double t, t0, due;
+    long long spent;
+    int n, first;
+    char* cmd_method = method;
+    char* cmd_vhost = vhost;
 
-		case ST_CONTENT_LENGTH:
-		switch ( buf[bytes_handled] )
-		    {
-		    case ':':
-		    conn_state = ST_CONTENT_LENGTH_COLON;
-		    break;
-		    case '\n':
-		    conn_state = ST_LF;
-		    break;
-		    case '\r':
-		    conn_state = ST_CR;
-		    break;
-		    default:
-		    conn_state = ST_TEXT;
-		    break;
-		    }
-		break;
+    if ( strcmp( replay_file, "-" ) == 0 )
+	fp = stdin;
+    else
+	fp = fopen( replay_file, "r" );
+    if ( fp == (FILE*) 0 )
+	{
+	perror( replay_file );
+	exit( 1 );
+	}
+    (void) gettimeofday( &start, (struct timezone*) 0 );
+    t0 = 0.0;
+    first = 1;
+    while ( ! terminate && fgets( line, sizeof(line), fp ) != (char*) 0 )
+	{
+	if ( strchr( line, '\n' ) == (char*) 0 && ! feof( fp ) )
+	    {
+	    /* Too long; skip the rest of it. */
+	    while ( fgets( line, sizeof(line), fp ) != (char*) 0 &&
+		    strchr( line, '\n' ) == (char*) 0 )
+		;
+	    ++replay_bad_lines;
+	    continue;
+	    }
+	if ( line[strspn( line, " \t\r\n" )] == '\0' || line[0] == '#' )
+	    continue;
+	replay_vhost[0] = '\0';
+	req_body_len = 0;
+	n = sscanf(
+	    line, "%lf %31s %1999s %499s %ld", &t, replay_method, replay_path,
+	    replay_vhost, &req_body_len );
+	/* A path that fills replay_path was probably cut short. */
+	if ( n < 3 || replay_path[0] != '/' || req_body_len < 0 ||
+	     strlen( replay_path ) >= sizeof(replay_path) - 1 )
+	    {
+	    ++replay_bad_lines;
+	    continue;
+	    }
+	if ( first )
+	    {
+	    t0 = t;
+	    first = 0;
+	    }
 
-		case ST_CONTENT_LENGTH_COLON:
-		switch ( buf[bytes_handled] )
-		    {
-		    case ' ': case '\t':
-		    conn_state = ST_CONTENT_LENGTH_COLON_WHITESPACE;
-		    break;
-		    case '\n':
-		    conn_state = ST_LF;
-		    break;
-		    case '\r':
-		    conn_state = ST_CR;
-		    break;
-		    default:
-		    conn_state = ST_TEXT;
-		    break;
-		    }
+	/* Wait for its time, collecting probes as they finish. */
+	due = ( t - t0 ) / replay_speed * 1000000.0;
+	for (;;)
+	    {
+	    (void) gettimeofday( &now, (struct timezone*) 0 );
+	    spent = delta_timeval( &start, &now );
+	    if ( spent >= due || terminate )
 		break;
+	    wait_kids( (long long) due - spent );
+	    }
 
-		case ST_CONTENT_LENGTH_COLON_WHITESPACE:
-		switch ( buf[bytes_handled] )
-		    {
-		    case ' ': case '\t':
-		    break;
-		    case '0': case '1': case '2': case '3': case '4':
-		    case '5': case '6': case '7': case '8': case '9':
-		    content_length = buf[bytes_handled] - '0';
-		    conn_state = ST_CONTENT_LENGTH_COLON_WHITESPACE_NUM;
-		    break;
-		    case '\n':
-		    conn_state = ST_LF;
-		    break;
-		    case '\r':
-		    conn_state = ST_CR;
-		    break;
-		    default:
-		    conn_state = ST_TEXT;
-		    break;
-		    }
-		break;
+	method = replay_method;
+	url_filename = replay_path;
+	if ( replay_vhost[0] != '\0' && strcmp( replay_vhost, "-" ) != 0 )
+	    vhost = replay_vhost;
+	else
+	    vhost = cmd_vhost;
+	group_stats = key_lookup(
+	    &replay_paths, replay_path, strcspn( replay_path, "?" ),
+	    (char**) 0 );
+	send_probe();
+	}
+    if ( fp != stdin )
+	(void) fclose( fp );
+    group_stats = (probe_stats*) 0;
+    method = cmd_method;
+    vhost = cmd_vhost;
+    req_body_len = 0;
+    drain_kids();
+    }
 
-		case ST_CONTENT_LENGTH_COLON_WHITESPACE_NUM:
-		switch ( buf[bytes_handled] )
-		    {
-		    case '0': case '1': case '2': case '3': case '4':
-		    case '5': case '6': case '7': case '8': case '9':
-		    content_length =
-			content_length * 10 + buf[bytes_handled] - '0';
-		    break;
-		    case '\n':
-		    conn_state = ST_LF;
-		    break;
-		    case '\r':
-		    conn_state = ST_CR;
-		    break;
-		    default:
-		    conn_state = ST_TEXT;
-		    break;
-		    }
-		break;
 
-		case ST_DATA:
-		bytes += bytes_read - bytes_handled;
-		total_bytes += bytes_read - bytes_handled;
-		bytes_handled = bytes_read;
-		if ( content_length != -1 && bytes >= content_length )
-		    {
-		    close_connection();
-		    (void) gettimeofday( &finished_at, (struct timezone*) 0 );
-		    return 1;
-		    }
+static void
+profile_report( void )
+    {
+    int i;
+    char desc[200];
+
+    for ( i = 0; i < num_segments; ++i )
+	{
+	seg_describe( &segments[i], desc, sizeof(desc) );
+	(void) printf( "--- segment %d: %s\n", i + 1, desc );
+	report_stats( &seg_stats[i], 1 );
+	}
+    }
+
+
+/* -capacity: raise the open-loop rate until the SLO breaks, either a
+** step at a time or by bisecting between start and max.  cap_good ends
+** up as the highest rate that met it.
+*/
+static void
+capacity_search( void )
+    {
+    double rate, lo, hi, mid;
+    int r;
+
+    cap_good = 0.0;
+    if ( ! cap_binary )
+	{
+	for ( rate = cap_start; rate <= cap_max * 1.000001; rate += cap_step )
+	    {
+	    if ( capacity_step( rate ) <= 0 )
 		break;
-		}
+	    cap_good = rate;
 	    }
+	return;
+	}
+    if ( capacity_step( cap_start ) <= 0 )
+	return;
+    cap_good = lo = cap_start;
+    hi = cap_max;
+    r = capacity_step( hi );
+    if ( r > 0 )
+	cap_good = hi;
+    if ( r != 0 )
+	return;
+    while ( hi - lo > cap_step )
+	{
+	mid = ( lo + hi ) / 2.0;
+	r = capacity_step( mid );
+	if ( r < 0 )
+	    break;
+	if ( r > 0 )
+	    cap_good = lo = mid;
+	else
+	    hi = mid;
 	}
-    return 1;
     }
 
 
-static void
-handle_term( int sig )
+/* Holds one -capacity rate for the window.  Returns 1 if it met the SLO,
+** 0 if not, and -1 if we were interrupted before it finished.
+*/
+static int
+capacity_step( double rate )
     {
-    terminate = 1;
+    probe_stats g;
+    segment sg;
+    struct timeval start;
+    cap_result c;
+
+    (void) memset( (void*) &sg, 0, sizeof(sg) );
+    sg.shape = SH_CONST;
+    sg.secs = window_secs;
+    sg.a = rate;
+    clear_stats( &g );
+    group_stats = &g;
+    (void) gettimeofday( &start, (struct timezone*) 0 );
+    open_loop( &sg, &start );
+    drain_kids();
+    group_stats = (probe_stats*) 0;
+    if ( terminate )
+	return -1;
+
+    c.rate = rate;
+    c.achieved = g.completed / window_secs;
+    c.errors =
+	( g.failures + g.timeouts + g.invalid ) * 100.0 / max( g.started, 1 );
+    c.p50 = hist_percentile( &g.hist[PH_TOTAL], 50.0 ) / 1000.0;
+    c.p90 = hist_percentile( &g.hist[PH_TOTAL], 90.0 ) / 1000.0;
+    c.p99 = hist_percentile( &g.hist[PH_TOTAL], 99.0 ) / 1000.0;
+    c.pslo = hist_percentile( &g.hist[PH_TOTAL], slo_pct ) / 1000.0;
+    c.ok = g.completed > 0 && c.pslo <= slo_ms && c.errors <= slo_errors;
+    if ( num_cap_steps < MAX_CAP_STEPS )
+	cap_steps[num_cap_steps++] = c;
+    else
+	++cap_dropped;
+    (void) printf(
+	"capacity: %g rps: %d sent, %d completed, %g%% errors, p%g %g ms - %s\n",
+	rate, g.started, g.completed, c.errors, slo_pct, c.pslo,
+	c.ok ? "ok" : "over SLO" );
+    (void) fflush( stdout );
+    return c.ok;
     }
 
 
+/* The latency curve of the -capacity steps, by rate. */
 static void
-handle_alarm( int sig )
+capacity_report( void )
     {
-    close_connection();
-    (void) fprintf( stderr, "%s: timed out\n", url );
-    ++count_timeouts;
-    longjmp( jb, 0 );
+    int i, j;
+    cap_result c;
+
+    for ( i = 1; i < num_cap_steps; ++i )
+	for ( j = i; j > 0 && cap_steps[j - 1].rate > cap_steps[j].rate; --j )
+	    {
+	    c = cap_steps[j];
+	    cap_steps[j] = cap_steps[j - 1];
+	    cap_steps[j - 1] = c;
+	    }
+    (void) printf(
+	"--- capacity: p%g <= %g ms and errors <= %g%%, %g s per step\n",
+	slo_pct, slo_ms, slo_errors, window_secs );
+    for ( i = 0; i < num_cap_steps; ++i )
+	(void) printf(
+	    "%g rps: %g rps completed, %g%% errors, p50/p90/p99 = %g/%g/%g ms%s\n",
+	    cap_steps[i].rate, cap_steps[i].achieved, cap_steps[i].errors,
+	    cap_steps[i].p50, cap_steps[i].p90, cap_steps[i].p99,
+	    cap_steps[i].ok ? "" : " (over SLO)" );
+    if ( cap_dropped > 0 )
+	(void) printf(
+	    "%d more rates tried, not listed; only the first %d are kept\n",
+	    cap_dropped, MAX_CAP_STEPS );
+    if ( cap_good > 0.0 )
+	(void) printf( "sustainable rate: %g rps\n", cap_good );
+    else
+	(void) printf( "no rate tried met the SLO\n" );
     }
 
 
 static void
-close_connection( void )
+sleep_secs( double secs )
     {
-#ifdef USE_SSL
-    if ( url_protocol == PROTO_HTTPS )
-	SSL_free( ssl );
-#endif
-    (void) close( conn_fd );
+    struct timespec ts;
+
+    ts.tv_sec = (time_t) secs;
+    ts.tv_nsec = (long) ( ( secs - ts.tv_sec ) * 1000000000.0 );
+    (void) nanosleep( &ts, (struct timespec*) 0 );
     }
 
 
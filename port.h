@@ -79,6 +79,9 @@
 # define HAVE_LINUX_SENDFILE
 # define HAVE_SCANDIR
 # define HAVE_INT64T
+# define HAVE_TCP_INFO
+# define HAVE_SO_TIMESTAMPING
+# define HAVE_SCHED_SETAFFINITY
 #endif /* OS_Linux */
 
 #ifdef OS_Solaris